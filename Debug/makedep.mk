@@ -50,3 +50,11 @@ task.c
 
 vt100.c
 
+telemetry.c
+
+fmt.c
+
+bam.c
+
+hrtimer.c
+
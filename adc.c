@@ -8,8 +8,12 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
 #include <util/atomic.h>
 #include "adc.h"
+#include "system.h"
+#include "systick.h"
+#include "timer.h"
 
 // function prototypes for task states
 static task_slice_result_t adc_state_init(task_t*);
@@ -17,7 +21,7 @@ static task_slice_result_t adc_state_start(task_t*);
 static task_slice_result_t adc_state_sample(task_t*);
 static task_slice_result_t adc_state_record(task_t*);
 
-static const task_slice_callback_fp const adc_task_slices[] = {
+static const ROM task_slice_callback_fp const adc_task_slices[] = {
   adc_state_init,
   adc_state_start,
   adc_state_sample,
@@ -90,12 +94,111 @@ static task_slice_result_t adc_state_start(task_t *task) {
 static task_slice_result_t adc_state_sample(task_t *task) {
   task_slice_result_t result = { TASK_STATE_RECORD, TASK_END };
   assert(Mutex.have_lock(&ADC_DEV->lock, task) && "Task does not own mutex");
+  adc_task_data_t *data = task->fdata;
 	
-  adc_atmega_se_start(ADC_DEV->regs);
+  if (ADC_DEV->quiet_mask & (1 << data->channel)) {
+    ADC_DEV->quiet_wait = ADC_QUIET_TICKS;
+    ADC_DEV->quiet_pending = true;
+  }
+  else
+    adc_atmega_se_start(ADC_DEV->regs);
 	
   return result;
 }
 
+/**
+ * Schedule every task parked on a window comparator
+ * @param w window comparator
+ * @return void
+ */
+static inline void adc_window_wake(adc_window_t *w) {
+  list_t *lnode;
+  while ((lnode = List.removeFront(&w->waiting))) {
+    Task.schedule(task_list_entry(lnode), TASK_SCHED_IMMED);
+  }
+}
+
+/**
+ * Run the window comparator of a channel and signal a state change
+ *
+ * An alarm state is only left once the value is hyst back inside the
+ * window, so a value dithering on a threshold signals once.
+ *
+ * @param ch channel
+ * @param v filtered value
+ * @return void
+ */
+static inline void adc_window_check(adc_channel_t ch, adc_data_t v) {
+  adc_window_t *w = &ADC_DEV->window[ch];
+  uint8_t state = w->state;
+  uint8_t next;
+
+  if (state == ADC_WINDOW_OFF) return;
+
+  if (v > w->high)
+    next = ADC_WINDOW_HIGH;
+  else if (v < w->low)
+    next = ADC_WINDOW_LOW;
+  else if ((state == ADC_WINDOW_HIGH && v > w->high - w->hyst) ||
+           (state == ADC_WINDOW_LOW && v < w->low + w->hyst))
+    next = state;
+  else
+    next = ADC_WINDOW_IN;
+
+  if (next == state) return;
+
+  w->state = next;
+  ADC_DEV->window_events |= 1 << ch;
+  adc_window_wake(w);
+}
+
+/**
+ * Store a fresh sample, queue it in the channel's FIFO, run it through
+ * the channel's filter and window comparator
+ *
+ * Called from the conversion path, so every branch is a handful of adds
+ * and shifts plus at most one 16x8 multiply.
+ *
+ * @param ch channel the sample was taken on
+ * @param raw 10-bit conversion result
+ * @return void
+ */
+static inline void adc_store(adc_channel_t ch, adc_data_t raw) {
+  adc_filter_t *f = &ADC_DEV->filter[ch];
+  adc_fifo_t *fifo = ADC_DEV->fifo[ch];
+  ADC_DEV->data[ch] = raw;
+  if (fifo)
+    adc_fifo_put(fifo, (adc_sample_t){ systick_get(), raw });
+
+  switch (f->mode) {
+  case ADC_FILTER_DECIMATE:
+    f->acc += raw;
+    if (++f->count == (uint8_t)(1 << (2 * f->arg))) {
+      f->value = f->acc >> f->arg;
+      f->acc = 0;
+      f->count = 0;
+    }
+    break;
+  case ADC_FILTER_AVERAGE:
+    f->acc += raw - f->hist[f->count];
+    f->hist[f->count] = raw;
+    f->count = (f->count + 1) & ((1 << f->arg) - 1);
+    f->value = f->acc >> f->arg;
+    break;
+  case ADC_FILTER_IIR: {
+    int16_t delta = (int16_t)(raw << ADC_IIR_FRAC) - f->state;
+    f->state += ((int32_t)delta * f->arg + 128) >> 8;
+    f->value = (f->state + (1 << (ADC_IIR_FRAC - 1))) >> ADC_IIR_FRAC;
+    break;
+  }
+  default:
+    f->value = raw;
+    break;
+  }
+
+  adc_window_check(ch, f->value);
+}
+
 /**
  * adc task callback to record the sampled value
  *
@@ -107,22 +210,137 @@ static task_slice_result_t adc_state_record(task_t *task) {
   assert(Mutex.have_lock(&ADC_DEV->lock, task) && "Task does not own mutex");
   adc_task_data_t *data = task->fdata;
 	
-  ADC_DEV->data[data->channel] = adc_atmega_se_read(ADC_DEV->regs);
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    adc_store(data->channel, adc_atmega_se_read(ADC_DEV->regs));
+  }
   ADC_DEV->current = NULL;
   if (!task->enabled) result.sched = TASK_END;
   Mutex.unlock(&ADC_DEV->lock, task);
   return result;
 }
 
+/**
+ * Pick the channel to convert after ch in scan mode
+ *
+ * @param ch channel just converted
+ * @return next channel in ADC_DEV->scan_mask, wrapping around
+ */
+static inline adc_channel_t adc_scan_next(adc_channel_t ch) {
+  uint8_t mask = ADC_DEV->scan_mask;
+  do {
+    ch = (ch + 1) & 7;
+  } while (!(mask & (1 << ch)));
+  return ch;
+}
+
+/**
+ * Schedule the first scan group trigger on the free running Timer1
+ *
+ * OCR1B is pushed one period further each group by the ISR, which keeps
+ * Timer1 shared with the hrtimer service on OCR1A.
+ *
+ * @param hz trigger rate, 0 to stop triggering, hrtimer_init done
+ * @return void
+ */
+static void adc_trigger_timer(uint16_t hz) {
+  if (!hz) return;
+  ADC_DEV->scan_period = HRTIMER_HZ / hz;
+  DEV_TIMER1->regs.t16->OCRxB = hrtimer_now() + ADC_DEV->scan_period;
+  TIFR1 = _BV(OCF1B);
+}
+
+/**
+ * Configure scan mode
+ *
+ * @param mask channels to scan, 0 stops scanning
+ * @param hz scan group rate, 0 to free run, else ADC_SCAN_HZ_MIN at least
+ * @return false if a channel task owns the ADC right now, hz is too low
+ *         or Timer1 runs PWM so there is no time base to trigger from
+ */
+static bool adc_scan_setup(uint8_t mask, uint16_t hz) {
+  bool result = true;
+  if (mask && hz && hz < ADC_SCAN_HZ_MIN) return false;
+  if (mask && hz && !hrtimer_init()) return false;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (ADC_DEV->lock.owner) {
+      result = false;
+    }
+    else {
+      for (uint8_t i = 0; i < 8; i++)
+        Task.disable(&adc_tasks[i]);
+      ADC_DEV->scan_mask = mask;
+
+      if (hz != ADC_DEV->scan_hz || !mask) {
+        ADC_DEV->scan_hz = mask ? hz : 0;
+        adc_trigger_timer(ADC_DEV->scan_hz);
+        if (ADC_DEV->scan_hz)
+          adc_atmega_auto_trigger(ADC_DEV->regs, ADC_ATMEGA_TRIGGER_TIMER1_COMPB);
+        else
+          adc_atmega_manual_trigger(ADC_DEV->regs);
+      }
+
+      // otherwise the ISR picks the new mask up after the current conversion
+      if (mask && !adc_atmega_is_pending(ADC_DEV->regs)) {
+        adc_atmega_change_channel(ADC_DEV->regs, adc_scan_next(7));
+        if (!hz) adc_atmega_se_start(ADC_DEV->regs);
+      }
+    }
+  }
+  return result;
+}
+
+/**
+ * Start or stop free running scan mode
+ *
+ * In scan mode the ADC ISR stores each result in ADC_DEV->data, switches
+ * ADMUX to the next channel in mask and starts the next conversion, so
+ * sampling costs no task slices at all. The per-channel tasks are
+ * stopped; ADC_.start/stop add and remove scan channels instead.
+ *
+ * @param mask bit n set scans channel n, 0 stops scanning after the
+ *        conversion in progress
+ * @return false if a channel task owns the ADC right now, try again later
+ */
+static bool adc_scan(uint8_t mask) {
+  return adc_scan_setup(mask, 0);
+}
+
+/**
+ * Start hardware timed scan mode
+ *
+ * Timer1 compare match B auto-triggers the first conversion of each
+ * group, the ISR converts the remaining channels back to back, then the
+ * ADC idles until the next trigger. Every channel is therefore sampled
+ * at exactly hz with a fixed skew of one conversion time (104us at the
+ * default prescaler) between neighbours. Timer1 free runs as the hrtimer
+ * time base, so pwm_init refuses PWM1A and PWM1B from then on.
+ *
+ * @param mask bit n set scans channel n, 0 stops scanning
+ * @param hz group rate, ADC_SCAN_HZ_MIN (16) at least, and low enough
+ *        to convert every channel within one period
+ * @return false if hz is below ADC_SCAN_HZ_MIN or PWM1A/PWM1B already
+ *         run Timer1, or if a channel task owns the ADC right now, try
+ *         again later
+ */
+static bool adc_scan_rate(uint8_t mask, uint16_t hz) {
+  return adc_scan_setup(mask, hz);
+}
+
 /**
  * Start sampling an ADC channel
  *
  * @param ch channel
- * @param interval sampling interval in system ticks
+ * @param interval sampling interval in system ticks, unused in scan mode
  * @return void
  * @note all channels are stopped by default
  */
 static void adc_start_channel(adc_channel_t ch, tick_t interval) {
+  if (ADC_DEV->scan_mask) {
+    adc_scan_setup(ADC_DEV->scan_mask | (1 << ch), ADC_DEV->scan_hz);
+    return;
+  }
+
   task_t *task = &adc_tasks[ch];
   Task.set_ticks(task, interval);
   Task.enable(task);
@@ -139,11 +357,14 @@ static void adc_start_channel(adc_channel_t ch, tick_t interval) {
  *       started doing so
  */
 static inline void adc_stop_channel(adc_channel_t ch) {
-  Task.disable(&adc_tasks[ch]);
+  if (ADC_DEV->scan_mask)
+    adc_scan_setup(ADC_DEV->scan_mask & ~(1 << ch), ADC_DEV->scan_hz);
+  else
+    Task.disable(&adc_tasks[ch]);
 }
 
 /**
- * Atomic get most recent value read on ADC channel
+ * Atomic get most recent raw value read on ADC channel
  *
  * @param ch channel to get
  * @return adc value 
@@ -156,6 +377,240 @@ static inline adc_data_t adc_read_value(adc_channel_t ch) {
   return result;
 }
 
+/**
+ * Configure the processing stage of a channel
+ *
+ * The filter state is primed with the latest raw value so averages and
+ * the IIR do not ramp up from zero. Decimation only gains resolution
+ * when the input carries at least 1 LSB of noise.
+ *
+ * @param ch channel
+ * @param mode filter to run on every sample
+ * @param arg extra bits (1..3) for ADC_FILTER_DECIMATE, log2 of the window
+ *        (1..ADC_AVERAGE_LOG2_MAX) for ADC_FILTER_AVERAGE, alpha in Q0.8
+ *        (1..255) for ADC_FILTER_IIR, ignored otherwise
+ * @return false if arg is out of range for mode
+ */
+static bool adc_set_filter(adc_channel_t ch, adc_filter_mode_t mode, uint8_t arg) {
+  if ((mode == ADC_FILTER_DECIMATE && (arg < 1 || arg > 3)) ||
+      (mode == ADC_FILTER_AVERAGE && (arg < 1 || arg > ADC_AVERAGE_LOG2_MAX)) ||
+      (mode == ADC_FILTER_IIR && arg < 1))
+    return false;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    adc_filter_t *f = &ADC_DEV->filter[ch];
+    adc_data_t raw = ADC_DEV->data[ch];
+    f->mode = mode;
+    f->arg = arg;
+    f->count = 0;
+    f->value = raw;
+    if (mode == ADC_FILTER_IIR) {
+      f->state = raw << ADC_IIR_FRAC;
+    }
+    else if (mode == ADC_FILTER_AVERAGE) {
+      for (uint8_t i = 0; i < (1 << arg); i++)
+        f->hist[i] = raw;
+      f->acc = raw << arg;
+    }
+    else {
+      f->acc = 0;
+    }
+  }
+  return true;
+}
+
+/**
+ * Atomic get most recent filtered value on ADC channel
+ *
+ * @param ch channel to get
+ * @return filtered value, 10+n bits wide for ADC_FILTER_DECIMATE
+ */
+static inline adc_data_t adc_read_filtered(adc_channel_t ch) {
+  uint16_t result;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    result = ADC_DEV->filter[ch].value;
+  }
+  return result;
+}
+
+/**
+ * Attach a sample FIFO to a channel, or detach it
+ *
+ * Every sample recorded on ch from then on is queued with its systick.
+ * When the consumer falls behind new samples are dropped and counted in
+ * adc_fifo_drops(fifo).
+ *
+ * @param ch channel
+ * @param fifo FIFO object owned by the caller, NULL detaches
+ * @param storage sample storage owned by the caller
+ * @param size slots in storage, power of two up to 256
+ * @return void
+ */
+static void adc_set_fifo(adc_channel_t ch, adc_fifo_t *fifo,
+                         adc_sample_t *storage, uint16_t size) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (fifo) adc_fifo_init(fifo, storage, size);
+    ADC_DEV->fifo[ch] = fifo;
+  }
+}
+
+/**
+ * Configure the window comparator of a channel
+ *
+ * The comparator starts in ADC_WINDOW_IN, so a channel that is already
+ * out of range signals on its next sample. Tasks parked on the old
+ * setting are woken if this changes the state, turning the comparator
+ * off included.
+ *
+ * @param ch channel
+ * @param low lowest in-range filtered value
+ * @param high highest in-range filtered value, below low turns the
+ *        comparator off
+ * @param hyst distance back inside the window needed to clear an alarm
+ * @return false if hyst is wider than the window
+ */
+static bool adc_set_window(adc_channel_t ch, adc_data_t low, adc_data_t high,
+                           adc_data_t hyst) {
+  adc_window_t *w = &ADC_DEV->window[ch];
+  if (high >= low && hyst > high - low) return false;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    uint8_t state = (high < low) ? ADC_WINDOW_OFF : ADC_WINDOW_IN;
+    w->low = low;
+    w->high = high;
+    w->hyst = hyst;
+    ADC_DEV->window_events &= ~(1 << ch);
+    if (w->state != state) {
+      w->state = state;
+      adc_window_wake(w);
+    }
+  }
+  return true;
+}
+
+/**
+ * Current window comparator state of a channel
+ *
+ * @param ch channel
+ * @return adc_window_state_t
+ */
+static adc_window_state_t adc_window_state(adc_channel_t ch) {
+  return ADC_DEV->window[ch].state;
+}
+
+/**
+ * Park a task until the window comparator of a channel changes state
+ *
+ * For use as the sched value of a slice result, the task runs its next
+ * slice on the first crossing after this call. A task that is already on
+ * a list (queued to run, or parked here or elsewhere) is left where it
+ * is.
+ *
+ * @param ch channel
+ * @param task task to wake
+ * @return TASK_WAIT, TASK_SCHED_IMMED if the comparator is off
+ */
+static task_sched_t adc_window_wait(adc_channel_t ch, task_t *task) {
+  task_sched_t result = TASK_WAIT;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (ADC_DEV->window[ch].state == ADC_WINDOW_OFF)
+      result = TASK_SCHED_IMMED;
+    else if (List.isEmpty(task_list_node(task)))
+      List.addAtRear(&ADC_DEV->window[ch].waiting, task_list_node(task));
+  }
+  return result;
+}
+
+/**
+ * Fetch and clear the window event flags
+ *
+ * @param void
+ * @return bit n set if channel n changed window state since the last call
+ */
+static uint8_t adc_window_events(void) {
+  uint8_t events;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    events = ADC_DEV->window_events;
+    ADC_DEV->window_events = 0;
+  }
+  return events;
+}
+
+static scheduler_idle_fp adc_idle_next = NULL;
+static bool adc_idle_installed = false;
+
+/**
+ * Scheduler idle hook, runs a pending quiet conversion, otherwise hands
+ * over to the hook installed before it
+ *
+ * Entering SLEEP_MODE_ADC with the ADC enabled starts the conversion, and
+ * the ADC interrupt wakes the core once it is done. Since this only runs
+ * when no task is ready, nothing is starved by the sleep; adc_tick starts
+ * the conversion instead if the scheduler stays busy.
+ *
+ * @param void
+ * @return void, with interrupts enabled
+ */
+static void adc_idle(void) {
+  if (ADC_DEV->quiet_pending) {
+    ADC_DEV->quiet_pending = false;
+    set_sleep_mode(SLEEP_MODE_ADC);
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+  }
+  else if (adc_idle_next) {
+    adc_idle_next();
+  }
+  sei();
+}
+
+/**
+ * Start a quiet conversion the idle path did not get to in time, called
+ * from the systick interrupt
+ *
+ * Whichever of this and adc_idle clears quiet_pending first starts the
+ * conversion, both run with interrupts disabled.
+ *
+ * @param void
+ * @return void
+ */
+void adc_tick(void) {
+  if (ADC_DEV->quiet_pending && --ADC_DEV->quiet_wait == 0) {
+    ADC_DEV->quiet_pending = false;
+    adc_atmega_se_start(ADC_DEV->regs);
+  }
+}
+
+/**
+ * Convert a channel in ADC noise reduction sleep
+ *
+ * The task-mode sample slice leaves the conversion to the scheduler idle
+ * path, which halts the core while the ADC converts. Sampling on such a
+ * channel waits for the scheduler to go idle, for at most ADC_QUIET_TICKS
+ * systicks, then converts without the sleep. While asleep clkIO is
+ * stopped: the systick stretches by up to one conversion time (104us)
+ * and a USART byte arriving mid-conversion is lost unless flow control
+ * holds the sender off. Scan mode ignores this setting.
+ *
+ * @param ch channel
+ * @param quiet true to convert ch in noise reduction sleep
+ * @return void
+ */
+static void adc_set_quiet(adc_channel_t ch, bool quiet) {
+  if (quiet) {
+    ADC_DEV->quiet_mask |= 1 << ch;
+    if (!adc_idle_installed) {
+      adc_idle_next = scheduler_set_idle(adc_idle);
+      adc_idle_installed = true;
+    }
+  }
+  else {
+    ADC_DEV->quiet_mask &= ~(1 << ch);
+  }
+}
+
 /**
  * Initialize adc device, tasks, and all channels
  *
@@ -166,24 +621,71 @@ static void adc_init(void) {
   adc_atmega_init(ADC_DEV->regs);
   Mutex.init(&ADC_DEV->lock);
   ADC_DEV->current = NULL;
+  ADC_DEV->scan_mask = 0;
+  ADC_DEV->scan_hz = 0;
+  ADC_DEV->scan_period = 0;
+  ADC_DEV->window_events = 0;
+  ADC_DEV->quiet_mask = 0;
+  ADC_DEV->quiet_pending = false;
+  ADC_DEV->quiet_wait = 0;
   int i;
   for (i = 0; i < 8; i++) {
-    adc_task_data[i].channel = i;		
+    adc_task_data[i].channel = i;
+    adc_set_filter(i, ADC_FILTER_NONE, 0);
+    ADC_DEV->fifo[i] = NULL;
+    ADC_DEV->window[i].state = ADC_WINDOW_OFF;
+    List.init(&ADC_DEV->window[i].waiting);		
     Task.init(&adc_tasks[i], adc_task_slices, &adc_task_data[i]);
     Task.disable(&adc_tasks[i]);
   }
 }
 
 ISR(ADC_vect) {
-  Task.schedule(ADC_DEV->current, TASK_SCHED_IMMED);
+  if (ADC_DEV->scan_mask) {
+    // ADMUX still holds the channel that was just converted
+    adc_channel_t ch = adc_atmega_get_channel(ADC_DEV->regs);
+    adc_channel_t next = adc_scan_next(ch);
+    adc_store(ch, adc_atmega_se_read(ADC_DEV->regs));
+    adc_atmega_change_channel(ADC_DEV->regs, next);
+
+    if (!ADC_DEV->scan_hz || next > ch) {
+      adc_atmega_se_start(ADC_DEV->regs);
+    }
+    else {
+      // group done, rearm the trigger: only a rising OCF1B starts the next
+      timer16_atmega_reg_t *t1 = DEV_TIMER1->regs.t16;
+      uint16_t start = t1->OCRxB;
+      uint16_t period = ADC_DEV->scan_period;
+
+      // a group that overran its period would leave the next compare in
+      // the past, 65 ms away; re-base on now, with slack for this write
+      if ((uint16_t)(t1->TCNTx - start) >= period - 2)
+        start = t1->TCNTx;
+      t1->OCRxB = start + period;
+      TIFR1 = _BV(OCF1B);
+    }
+  }
+  else if (ADC_DEV->current) {
+    Task.schedule(ADC_DEV->current, TASK_SCHED_IMMED);
+  }
 }
 
 /**
  * Public Interface Class for ADC device
  */
-const adc_class_t ADC_ = {
+const ROM adc_class_t ADC_ = {
   .init = adc_init,
   .start = adc_start_channel,
   .stop = adc_stop_channel,
-  .read = adc_read_value
+  .read = adc_read_value,
+  .scan = adc_scan,
+  .scan_rate = adc_scan_rate,
+  .filter = adc_set_filter,
+  .read_filtered = adc_read_filtered,
+  .fifo = adc_set_fifo,
+  .window = adc_set_window,
+  .window_state = adc_window_state,
+  .window_wait = adc_window_wait,
+  .window_events = adc_window_events,
+  .quiet = adc_set_quiet
 }; 
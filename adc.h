@@ -13,15 +13,93 @@
 #include "atmega/adc_atmega.h"
 #include "task.h"
 #include "task_mutex.h"
+#include "ring_buffer.h"
+#include "hrtimer.h"
 
 typedef uint16_t adc_data_t;
 typedef uint8_t adc_channel_t;
 
+// slowest timed scan, one group period must fit the 16-bit Timer1 count
+#define ADC_SCAN_HZ_MIN (HRTIMER_HZ / UINT16_MAX + 1)
+
+// longest moving average window is 2^ADC_AVERAGE_LOG2_MAX samples, each
+// step costs 2 bytes of SRAM per channel
+#define ADC_AVERAGE_LOG2_MAX 2
+// fractional bits kept in the IIR state, 10 + ADC_IIR_FRAC must fit int16
+#define ADC_IIR_FRAC 5
+// systicks a quiet conversion waits for the idle path before it is
+// started normally, 1..255
+#ifndef ADC_QUIET_TICKS
+#define ADC_QUIET_TICKS 10
+#endif
+
+typedef enum {
+  ADC_FILTER_NONE,     // filtered value follows the raw value
+  ADC_FILTER_DECIMATE, // sum 4^n samples, emit 10+n bits every 4^n, n = 1..3
+  ADC_FILTER_AVERAGE,  // moving average over 2^n samples
+  ADC_FILTER_IIR       // y += a * (x - y), a = arg / 256
+} adc_filter_mode_t;
+
+typedef struct {
+  uint8_t mode;
+  uint8_t arg;
+  uint8_t count;
+  union {
+    uint16_t acc;  // decimate and average running sum
+    int16_t state; // IIR output in Q10.ADC_IIR_FRAC
+  };
+  adc_data_t value;
+  adc_data_t hist[1 << ADC_AVERAGE_LOG2_MAX];
+} adc_filter_t;
+
+typedef enum {
+  ADC_WINDOW_OFF,
+  ADC_WINDOW_IN,   // inside [low, high]
+  ADC_WINDOW_LOW,  // fell below low, until it is back above low + hyst
+  ADC_WINDOW_HIGH  // rose above high, until it is back below high - hyst
+} adc_window_state_t;
+
+/**
+ * Window comparator on the filtered value of a channel
+ */
+typedef struct {
+  adc_data_t low;
+  adc_data_t high;
+  adc_data_t hyst;
+  volatile uint8_t state;
+  list_t waiting;
+} adc_window_t;
+
+/**
+ * One FIFO entry: raw value and the systick it was recorded at
+ */
+typedef struct {
+  tick_t ticks;
+  adc_data_t value;
+} adc_sample_t;
+
+/**
+ * Per-channel sample FIFO, filled at conversion time. Consumers drain it
+ * in blocks with adc_fifo_read(fifo, dst, n), park on adc_fifo_wait_data
+ * and read the overflow count with adc_fifo_drops.
+ */
+RING_BUFFER_DECLARE(adc_fifo, adc_sample_t, uint8_t)
+
 typedef struct {
   task_mutex_t lock;
   task_t *current;
   adc_data_t data[8];
+  adc_filter_t filter[8];
+  adc_fifo_t *fifo[8];
+  adc_window_t window[8];
+  volatile uint8_t window_events; // bit n set when channel n changed state
+  uint8_t quiet_mask;             // channels converted in noise reduction sleep
+  volatile bool quiet_pending;    // a quiet conversion waits for the idle path
+  volatile uint8_t quiet_wait;    // systicks left before it starts anyway
   adc_atmega_regs_t *regs;
+  volatile uint8_t scan_mask; // channels converted round-robin by the ISR
+  uint16_t scan_hz;           // scan group rate, 0 when free running
+  uint16_t scan_period;       // Timer1 ticks between scan groups
 } adc_dev_t;
 
 typedef struct {
@@ -44,8 +122,20 @@ typedef struct {
   void (* const start)(adc_channel_t, tick_t);
   void (* const stop)(adc_channel_t);
   adc_data_t (* const read)(adc_channel_t);
+  bool (* const scan)(uint8_t);
+  bool (* const scan_rate)(uint8_t, uint16_t);
+  bool (* const filter)(adc_channel_t, adc_filter_mode_t, uint8_t);
+  adc_data_t (* const read_filtered)(adc_channel_t);
+  void (* const fifo)(adc_channel_t, adc_fifo_t*, adc_sample_t*, uint16_t);
+  bool (* const window)(adc_channel_t, adc_data_t, adc_data_t, adc_data_t);
+  adc_window_state_t (* const window_state)(adc_channel_t);
+  task_sched_t (* const window_wait)(adc_channel_t, task_t*);
+  uint8_t (* const window_events)(void);
+  void (* const quiet)(adc_channel_t, bool);
 } adc_class_t;
 
-extern const adc_class_t ADC_ ;
+extern const ROM adc_class_t ADC_ ;
+
+void adc_tick(void);
 
 #endif /* DEVICE_ADC_H_ */
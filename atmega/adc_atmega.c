@@ -13,7 +13,7 @@
 void adc_atmega_init_default(adc_atmega_regs_t *regs) {
 	regs->didr0 = 0b11111111; // disable digital input
 	regs->admux = 0b01000000; // avcc=3.3v, adlar=0, channel 0
-	regs->adcsrb = 0; // free running mode -- run, Forrest, run
+	regs->adcsrb = 0; // free running source, unused until ADATE is set
 	// enable, start, auto-trigger, isr flag, isr enable, prescaler = 64
 	// 1     , 0    , 0           , 0       , 1         , 110
 	regs->adcsra = 0b10001110;
@@ -27,6 +27,27 @@ inline bool adc_atmega_is_busy(adc_atmega_regs_t *regs) {
 	return bit_is_set(regs->adcsra, ADSC);
 }
 
+/**
+ * A conversion is running or its interrupt has not been serviced yet
+ */
+inline bool adc_atmega_is_pending(adc_atmega_regs_t *regs) {
+	return regs->adcsra & (_BV(ADSC) | _BV(ADIF));
+}
+
+/**
+ * Start conversions on the rising edge of an interrupt flag
+ *
+ * ADIF is written back as 0 so a pending ADC interrupt is not cleared.
+ */
+void adc_atmega_auto_trigger(adc_atmega_regs_t *regs, uint8_t source) {
+	REG_SETBITS(regs->adcsrb, source, ADTS_SIZE, ADTS_OFF);
+	regs->adcsra = (regs->adcsra & ~_BV(ADIF)) | _BV(ADATE);
+}
+
+void adc_atmega_manual_trigger(adc_atmega_regs_t *regs) {
+	regs->adcsra &= ~(_BV(ADATE) | _BV(ADIF));
+}
+
 inline bool adc_atmega_se_start(adc_atmega_regs_t *regs) {
 	if (adc_atmega_is_busy(regs)) return false;
 	REG_SETBIT(regs->adcsra, ADSC);
@@ -37,6 +58,10 @@ inline void adc_atmega_change_channel(adc_atmega_regs_t *regs, adc_channel_t ch)
 	REG_SETBITS(regs->admux, ch, ADMUX_SIZE, ADMUX_OFF);
 }
 
+inline adc_channel_t adc_atmega_get_channel(adc_atmega_regs_t *regs) {
+	return (regs->admux >> ADMUX_OFF) & ((1 << ADMUX_SIZE) - 1);
+}
+
 inline uint16_t adc_atmega_se_read(adc_atmega_regs_t *regs) {
 	uint16_t result = regs->adcl;
 	result |= (regs->adch << 8);
@@ -14,6 +14,12 @@
 
 #define ADMUX_SIZE 5
 #define ADMUX_OFF  0
+#define ADTS_SIZE  3
+#define ADTS_OFF   0
+
+// auto trigger sources (see table 20-6 pg 259)
+#define ADC_ATMEGA_TRIGGER_TIMER0_COMPA 0b011
+#define ADC_ATMEGA_TRIGGER_TIMER1_COMPB 0b101
 
 typedef uint8_t adc_channel_t;
 
@@ -40,8 +46,12 @@ typedef struct {
 
 void adc_atmega_init(adc_atmega_regs_t*);
 bool adc_atmega_is_busy(adc_atmega_regs_t*);
+bool adc_atmega_is_pending(adc_atmega_regs_t*);
+void adc_atmega_auto_trigger(adc_atmega_regs_t *regs, uint8_t source);
+void adc_atmega_manual_trigger(adc_atmega_regs_t *regs);
 bool adc_atmega_se_start(adc_atmega_regs_t *regs);
 void adc_atmega_change_channel(adc_atmega_regs_t *regs, adc_channel_t ch);
+adc_channel_t adc_atmega_get_channel(adc_atmega_regs_t *regs);
 uint16_t adc_atmega_se_read(adc_atmega_regs_t*);
 
 #endif /* ADC_ATMEGA_H_ */
\ No newline at end of file
@@ -8,12 +8,16 @@
 #include <util/atomic.h>
 #include "usart_atmega.h"
 
-void usart_atmega_init(usart_atmega_regs_t *regs, register16_t baud) {
+void usart_atmega_init(usart_atmega_regs_t *regs, register16_t baud, bool u2x) {
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
 		
 		// Set baud rate
 		regs->UBRRxH = (uint8_t)(baud >> 8);
 		regs->UBRRxL = (uint8_t)baud;
+
+		// Control and Status Reg A
+		// 1 Double transmission speed (U2X) -- baud divisor 8 instead of 16
+		regs->UCSRxA = u2x ? _BV(U2X0) : 0;
 			
 		// Control and Status Reg B
 		// 7 Rx complete Interrupt enable -- 0b1
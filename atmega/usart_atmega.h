@@ -9,6 +9,7 @@
 #ifndef USART_ATMEGA_H_
 #define USART_ATMEGA_H_
 
+#include <stdbool.h>
 #include "types_atmega.h"
 
 typedef struct {
@@ -21,6 +22,6 @@ typedef struct {
 	register_t UDRx;	
 } usart_atmega_regs_t;
 
-void usart_atmega_init(usart_atmega_regs_t *regs, register16_t baud);
+void usart_atmega_init(usart_atmega_regs_t *regs, register16_t baud, bool u2x);
 
 #endif /* USART_ATMEGA_H_ */
\ No newline at end of file
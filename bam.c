@@ -0,0 +1,146 @@
+/*
+ * bam.c
+ *
+ * Bit angle modulation on plain GPIO pins, double buffered bit planes
+ * per port, driven by the Timer2 compare A ISR
+ */ 
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "bam.h"
+#include "timer.h"
+
+static gpio_pin_t *bam_pins[BAM_CHANNELS];
+static uint8_t bam_levels[BAM_CHANNELS];
+static uint8_t bam_count = 0;
+
+// pins of each port owned by the engine
+static uint8_t bam_mask[BAM_PORTS];
+// bit plane n of port p is planes[p][n], one set shown, one being built
+static uint8_t bam_planes[2][BAM_PORTS][BAM_BITS];
+static volatile uint8_t bam_front = 0;
+static volatile bool bam_flip = false;
+static uint8_t bam_bit = 0;
+
+/**
+ * Port index of a pin, the GPIO register blocks are contiguous
+ * @param pin GPIO pin
+ * @return 0 for GPIOA .. 3 for GPIOD
+ */
+static inline uint8_t bam_port(const gpio_pin_t *pin) {
+  return pin->gpio - GPIOA_ADDRESS;
+}
+
+/**
+ * Start Timer2 in CTC mode, prescaler 128, compare A interrupt
+ *
+ * Marks Timer2 initialized so a later timer_init from the PWM driver
+ * leaves it alone.
+ *
+ * @param void
+ * @return void
+ */
+void bam_init(void) {
+  timer8_atmega_reg_t *t2 = DEV_TIMER2->regs.t8;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    t2->TCCRxB = 0;
+    t2->TCCRxA = _BV(WGM21);
+    t2->TCNTx = 0;
+    t2->OCRxA = 0;
+    *(DEV_TIMER2->regs.TIMSKx) = _BV(OCIE2A);
+    t2->TCCRxB = _BV(CS22) | _BV(CS20);
+    DEV_TIMER2->initialized = true;
+  }
+}
+
+/**
+ * Hand a pin to the engine
+ *
+ * The pin is made an output and starts dark.
+ *
+ * @param pin GPIO pin
+ * @return channel number for bam_set, -1 if all channels are taken
+ */
+int8_t bam_attach(gpio_pin_t *pin) {
+  int8_t ch = -1;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (bam_count < BAM_CHANNELS) {
+      ch = bam_count++;
+      bam_pins[ch] = pin;
+      bam_levels[ch] = 0;
+      gpio_pin_set_value(pin, unset);
+      gpio_pin_set_direction(pin, out);
+      bam_mask[bam_port(pin)] |= _BV(pin->pin);
+    }
+  }
+  return ch;
+}
+
+/**
+ * Stage the level of a channel, shown after the next bam_commit
+ * @param ch channel from bam_attach
+ * @param level 0 (off) .. 255 (on)
+ * @return void
+ */
+void bam_set(uint8_t ch, uint8_t level) {
+  if (ch < bam_count) bam_levels[ch] = level;
+}
+
+/**
+ * Rebuild the back bit planes from the staged levels and show them from
+ * the start of the next frame
+ *
+ * @param void
+ * @return false if the previous commit is not shown yet, try again
+ *         later (at most one frame)
+ */
+bool bam_commit(void) {
+  if (bam_flip) return false;
+
+  uint8_t (*planes)[BAM_BITS] = bam_planes[bam_front ^ 1];
+  for (uint8_t p = 0; p < BAM_PORTS; p++)
+    for (uint8_t b = 0; b < BAM_BITS; b++)
+      planes[p][b] = 0;
+
+  for (uint8_t ch = 0; ch < bam_count; ch++) {
+    uint8_t level = bam_levels[ch];
+    uint8_t *plane = planes[bam_port(bam_pins[ch])];
+    uint8_t bit = _BV(bam_pins[ch]->pin);
+    for (uint8_t b = 0; b < BAM_BITS; b++, level >>= 1)
+      if (level & 1) plane[b] |= bit;
+  }
+
+  bam_flip = true;
+  return true;
+}
+
+/**
+ * @param void
+ * @return true until the last bam_commit is being shown
+ */
+bool bam_commit_pending(void) {
+  return bam_flip;
+}
+
+/**
+ * End of a plane: show the next one and hold it for 2^n ticks
+ */
+ISR(TIMER2_COMPA_vect) {
+  uint8_t bit = bam_bit = (bam_bit + 1) & (BAM_BITS - 1);
+  // first, CTC has no double buffering and plane 0 lasts a single tick
+  OCR2A = (1 << bit) - 1;
+
+  if (!bit && bam_flip) {
+    bam_front ^= 1;
+    bam_flip = false;
+  }
+
+  uint8_t (*planes)[BAM_BITS] = bam_planes[bam_front];
+  gpio_atmega_regs_t *port = GPIOA_ADDRESS;
+  for (uint8_t p = 0; p < BAM_PORTS; p++, port++) {
+    uint8_t mask = bam_mask[p];
+    if (mask)
+      port->PORTx = (port->PORTx & ~mask) | planes[p][bit];
+  }
+}
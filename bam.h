@@ -0,0 +1,40 @@
+/*
+ * bam.h
+ *
+ * Bit angle modulation on plain GPIO pins
+ *
+ * Each 8-bit level is shown as 8 bit planes. Plane n is held for 2^n
+ * ticks of Timer2 (16us each with the /128 prescaler), so a frame is 255
+ * ticks, about 245 Hz. The compare ISR fires once per plane instead of
+ * once per tick, and writes every port with attached pins once.
+ *
+ * bam_init takes Timer2 over for good (CTC mode, compare A interrupt), so
+ * PWM2A and PWM2B cannot be used alongside the engine: pwm_init on them
+ * no longer touches the timer, but their outputs would follow the BAM
+ * timing, not a PWM duty.
+ *
+ * The ISR rewrites the BAM bits of a port with a read-modify-write of
+ * PORTx. Other pins on the same port may still be driven, but only with
+ * interrupts off, as the gpio_pin_* setters do; a plain PORTx |= from a
+ * task can be interrupted and then put back stale BAM bits.
+ */ 
+
+
+#ifndef BAM_H_
+#define BAM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "gpio.h"
+
+#define BAM_CHANNELS 16
+#define BAM_PORTS 4   // GPIOA..GPIOD
+#define BAM_BITS 8
+
+void bam_init(void);
+int8_t bam_attach(gpio_pin_t *pin);
+void bam_set(uint8_t ch, uint8_t level);
+bool bam_commit(void);
+bool bam_commit_pending(void);
+
+#endif /* BAM_H_ */
@@ -25,7 +25,7 @@ static task_slice_result_t blink_callback(task_t *t) {
   return (task_slice_result_t){0,TASK_RESCHED};
 }
 
-static const task_slice_callback_fp const blink_task_slices[] = {
+static const ROM task_slice_callback_fp const blink_task_slices[] = {
   blink_callback
 };
 
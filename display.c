@@ -4,53 +4,88 @@
  * Created: 10/23/2013 11:37:59 PM
  *  Author: Greg Cook
  *
- * Display ADC values to terminal asyncronously
+ * Display ADC values to terminal asyncronously (render callbacks for
+ * the terminal compositor), and stream them as binary telemetry (one
+ * record per channel, channel ID = ADC channel)
  * Example of Single Task Slice with statically declared task
  */ 
 #include <stdlib.h>
 #include <util/atomic.h>
+#include "system.h"
 #include "systick.h"
 #include "adc.h"
 #include "task.h"
 #include "vt100.h"
+#include "telemetry.h"
+#include "fmt.h"
+#include <avr/pgmspace.h>
 
 /**
- * Statically declared task example
+ * Statically declared task example, streams the ADC readings as
+ * telemetry
  */
 static task_t display_task = {
   .start_ticks = 200 // 5 times/sec
 };
 
-static void display_time(void) {
+/**
+ * Render region 1: free SRAM and runtime
+ */
+static void display_time(term_t *t, int r, void *data) {
+  (void)data;
   tick_t systicks = systick_get();
   int s = systicks / 1000;
   int ms = systicks % 1000;
-  term_display_region(TERM0, 3, 3, "Runtime %d.%03d Seconds", s, ms);
+
+  term_display_region_P(t, r, 0, PSTR("Free SRAM %4u"), sys_free_sram());
+
+  fmt_sink_t *out = term_region_begin(t, r, 1);
+  fmt_str_P(out, PSTR("Runtime "));
+  fmt_int(out, s, 0, ' ');
+  fmt_char(out, '.');
+  fmt_int(out, ms, 3, '0');
+  fmt_str_P(out, PSTR(" s"));
+  term_region_end(t);
 }
 
-static task_slice_result_t term_display_callback(task_t *t) {
-  term_display_region(TERM0, 1, 0, "ADC Raw Values");
-  int val = ADC_.read(ADC_CH0);
-  term_display_region(TERM0, 1, 1, "ADC 0: Val [%4d]", val);
-	
-  val = ADC_.read(ADC_CH1);
-  term_display_region(TERM0, 1, 2, "ADC 1: Val [%4d]", val);
+/**
+ * Render region 0: one "ADC n: Val [xxxx]" line per channel
+ */
+static void display_adc(term_t *t, int r, void *data) {
+  (void)data;
+  fmt_str_P(term_region_begin(t, r, 0), PSTR("ADC Raw Values"));
+  term_region_end(t);
 
-  val = ADC_.read(ADC_CH2);
-  term_display_region(TERM0, 1, 3, "ADC 2: Val [%4d]", val);
+  for (adc_channel_t ch = ADC_CH0; ch <= ADC_CH2; ++ch) {
+    fmt_sink_t *out = term_region_begin(t, r, ch + 1);
+    fmt_str_P(out, PSTR("ADC "));
+    fmt_uint(out, ch, 0, ' ');
+    fmt_str_P(out, PSTR(": Val ["));
+    fmt_uint(out, ADC_.read(ch), 4, ' ');
+    fmt_char(out, ']');
+    term_region_end(t);
+  }
+}
 
-  display_time();
+static task_slice_result_t telemetry_callback(task_t *t) {
+  for (adc_channel_t ch = ADC_CH0; ch <= ADC_CH2; ++ch) {
+    uint16_t val = ADC_.read(ch);
+    telemetry_send(ch, &val, sizeof(val));
+  }
   return (task_slice_result_t){0,TASK_RESCHED};
 }
 
 /**
  * Single Task Slice
  */
-static const task_slice_callback_fp term_display_slices[] = {
-  term_display_callback
+static const ROM task_slice_callback_fp display_slices[] = {
+  telemetry_callback
 };
 
 void display_init(void) {
-  Task.init(&display_task, term_display_slices, NULL);
+  term_region_render(TERM0, 0, display_adc, NULL);
+  term_region_render(TERM0, 1, display_time, NULL);
+
+  Task.init(&display_task, display_slices, NULL);
   Task.schedule(&display_task, TASK_RESCHED);
 }
@@ -8,29 +8,37 @@
 #include "echo.h"
 #include "task.h"
 #include "vt100.h"
+#include "uart.h"
 #include <stdio.h>
 #include <ctype.h>
+#include <avr/pgmspace.h>
+
+#define ECHO_LINE_MAX 64
 
 static task_t * echo_task;
 
 static task_slice_result_t echo_task_callback(task_t *t) {
-  int c = fgetc(stdin);
-  while (c != EOF) {
-    if (c == '\r' || c== '\n')
-      printf("\n\r");
-    else
-      fputc(toupper(c), stdout);
-    c = fgetc(stdin);
+  uint8_t line[ECHO_LINE_MAX];
+  int16_t n;
+
+  // woken by the RX ISR once a whole line is in
+  while ((n = uart_rx_read_frame(UART0, line, sizeof(line))) >= 0) {
+    for (int16_t i = 0; i < n; ++i) {
+      if (line[i] != '\n')
+        fputc(toupper(line[i]), stdout);
+    }
+    printf_P(PSTR("\n\r"));
   }
 
-  return (task_slice_result_t){0, TASK_RESCHED};
+  return (task_slice_result_t){0, uart_rx_wait_frame(UART0, t)};
 }
 
-static const task_slice_callback_fp const echo_task_slices[] = {
+static const ROM task_slice_callback_fp const echo_task_slices[] = {
   echo_task_callback
 };
 
 void echo_init(void) {
-  echo_task = Task.new(echo_task_slices, NULL, 125, true);
-  Task.schedule(echo_task, TASK_RESCHED);
+  uart_rx_framing(UART0, UART_RX_LINE, '\r');
+  echo_task = Task.new(echo_task_slices, NULL, 0, true);
+  Task.schedule(echo_task, TASK_SCHED_IMMED);
 }
@@ -0,0 +1,268 @@
+/*
+ * fmt.c
+ *
+ * Integer only formatted output into a character sink, a small
+ * replacement for vfprintf on the display paths
+ */ 
+
+#include <avr/pgmspace.h>
+#include "fmt.h"
+
+static void fmt_uart_put(fmt_sink_t *out, char c) {
+  uart_putc(((fmt_uart_t *)out)->uart, c);
+}
+
+/**
+ * Make a sink that writes straight into a UART TX ring
+ * @param f Sink object
+ * @param uart UART device
+ * @return sink to pass to the fmt functions
+ */
+fmt_sink_t *fmt_uart_init(fmt_uart_t *f, uart_t *uart) {
+  f->sink.put = fmt_uart_put;
+  f->uart = uart;
+  return &f->sink;
+}
+
+/**
+ * Emit digits[0..n) in reverse, left padded to width
+ * @param out Output sink
+ * @param digits Digits, least significant first
+ * @param n Number of digits
+ * @param width Minimum field width
+ * @param pad Pad character, ' ' or '0'
+ * @param neg Emit a '-' sign
+ * @return void
+ */
+static void fmt_digits(fmt_sink_t *out, const char *digits, uint8_t n,
+                       uint8_t width, char pad, bool neg) {
+  uint8_t len = n + neg;
+
+  // a zero pad goes between the sign and the digits
+  if (neg && pad == '0') out->put(out, '-');
+  for (; width > len; --width) out->put(out, pad);
+  if (neg && pad != '0') out->put(out, '-');
+  while (n) out->put(out, digits[--n]);
+}
+
+/**
+ * Append a decimal magnitude with an optional sign
+ * @param out Output sink
+ * @param v Magnitude
+ * @param width Minimum field width, 0 for none
+ * @param pad Pad character, ' ' or '0'
+ * @param neg Emit a '-' sign
+ * @return void
+ */
+static void fmt_udec(fmt_sink_t *out, uint16_t v, uint8_t width, char pad, bool neg) {
+  char digits[5];
+  uint8_t n = 0;
+
+  do {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  fmt_digits(out, digits, n, width, pad, neg);
+}
+
+/**
+ * Append a single character
+ * @param out Output sink
+ * @param c Character
+ * @return void
+ */
+void fmt_char(fmt_sink_t *out, char c) {
+  out->put(out, c);
+}
+
+/**
+ * Append a string from SRAM
+ * @param out Output sink
+ * @param s String
+ * @return void
+ */
+void fmt_str(fmt_sink_t *out, const char *s) {
+  while (*s) out->put(out, *s++);
+}
+
+/**
+ * Append a string from flash
+ * @param out Output sink
+ * @param s String in PROGMEM
+ * @return void
+ */
+void fmt_str_P(fmt_sink_t *out, const char *s) {
+  char c;
+  while ((c = pgm_read_byte(s++))) out->put(out, c);
+}
+
+/**
+ * Append an unsigned decimal
+ * @param out Output sink
+ * @param v Value
+ * @param width Minimum field width, 0 for none
+ * @param pad Pad character, ' ' or '0'
+ * @return void
+ */
+void fmt_uint(fmt_sink_t *out, uint16_t v, uint8_t width, char pad) {
+  fmt_udec(out, v, width, pad, false);
+}
+
+/**
+ * Append a signed decimal
+ * @param out Output sink
+ * @param v Value
+ * @param width Minimum field width including the sign, 0 for none
+ * @param pad Pad character, ' ' or '0'
+ * @return void
+ */
+void fmt_int(fmt_sink_t *out, int16_t v, uint8_t width, char pad) {
+  if (v < 0)
+    fmt_udec(out, -(uint16_t)v, width, pad, true);
+  else
+    fmt_udec(out, v, width, pad, false);
+}
+
+/**
+ * Append a hexadecimal value
+ * @param out Output sink
+ * @param v Value
+ * @param width Minimum field width, 0 for none
+ * @param pad Pad character, ' ' or '0'
+ * @param upper Use A-F rather than a-f
+ * @return void
+ */
+void fmt_hex(fmt_sink_t *out, uint16_t v, uint8_t width, char pad, bool upper) {
+  char digits[4];
+  uint8_t n = 0;
+  char a = upper ? 'A' - 10 : 'a' - 10;
+
+  do {
+    uint8_t d = v & 0xF;
+    digits[n++] = d < 10 ? '0' + d : a + d;
+    v >>= 4;
+  } while (v);
+  fmt_digits(out, digits, n, width, pad, false);
+}
+
+/**
+ * Next format character, from SRAM or flash
+ * @param p Format string cursor, advanced
+ * @param pgm Format string is in PROGMEM
+ * @return character
+ */
+static inline char fmt_read(const char **p, bool pgm) {
+  char c = pgm ? pgm_read_byte(*p) : **p;
+  (*p)++;
+  return c;
+}
+
+/**
+ * Formatted output, see fmt.h for the supported conversions
+ * @param out Output sink
+ * @param fmt Format string
+ * @param pgm fmt is in PROGMEM
+ * @param ap Arguments
+ * @return void
+ */
+static void fmt_vformat(fmt_sink_t *out, const char *fmt, bool pgm, va_list ap) {
+  char c;
+
+  while ((c = fmt_read(&fmt, pgm))) {
+    if (c != '%') {
+      out->put(out, c);
+      continue;
+    }
+
+    char pad = ' ';
+    uint8_t width = 0;
+    c = fmt_read(&fmt, pgm);
+    if (c == '0') {
+      pad = '0';
+      c = fmt_read(&fmt, pgm);
+    }
+    while (c >= '0' && c <= '9') {
+      width = width * 10 + (c - '0');
+      c = fmt_read(&fmt, pgm);
+    }
+
+    switch (c) {
+    case 'd':
+    case 'i':
+      fmt_int(out, va_arg(ap, int), width, pad);
+      break;
+    case 'u':
+      fmt_uint(out, va_arg(ap, unsigned), width, pad);
+      break;
+    case 'x':
+    case 'X':
+      fmt_hex(out, va_arg(ap, unsigned), width, pad, c == 'X');
+      break;
+    case 'c':
+      out->put(out, va_arg(ap, int));
+      break;
+    case 's':
+      fmt_str(out, va_arg(ap, const char *));
+      break;
+    case 'S':
+      fmt_str_P(out, va_arg(ap, const char *));
+      break;
+    case '\0':
+      return;
+    default:
+      // %% and anything unsupported come out as is
+      out->put(out, c);
+      break;
+    }
+  }
+}
+
+/**
+ * Formatted output, see fmt.h for the supported conversions
+ * @param out Output sink
+ * @param fmt Format string in SRAM
+ * @param ap Arguments
+ * @return void
+ */
+void fmt_vprintf(fmt_sink_t *out, const char *fmt, va_list ap) {
+  fmt_vformat(out, fmt, false, ap);
+}
+
+/**
+ * Formatted output with the format string in flash
+ * @param out Output sink
+ * @param fmt Format string in PROGMEM
+ * @param ap Arguments
+ * @return void
+ */
+void fmt_vprintf_P(fmt_sink_t *out, const char *fmt, va_list ap) {
+  fmt_vformat(out, fmt, true, ap);
+}
+
+/**
+ * Formatted output, see fmt.h for the supported conversions
+ * @param out Output sink
+ * @param fmt Format string in SRAM
+ * @param ... Arguments, int sized
+ * @return void
+ */
+void fmt_printf(fmt_sink_t *out, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  fmt_vprintf(out, fmt, ap);
+  va_end(ap);
+}
+
+/**
+ * Formatted output with the format string in flash
+ * @param out Output sink
+ * @param fmt Format string in PROGMEM
+ * @param ... Arguments, int sized
+ * @return void
+ */
+void fmt_printf_P(fmt_sink_t *out, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  fmt_vprintf_P(out, fmt, ap);
+  va_end(ap);
+}
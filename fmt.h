@@ -0,0 +1,49 @@
+/*
+ * fmt.h
+ *
+ * Integer only formatted output into a character sink, either a UART TX
+ * ring (fmt_uart_t) or anything else providing a put function, such as
+ * a terminal's shadow screen
+ *
+ * fmt_printf understands the subset of printf the display code uses:
+ *   %d %i %u %x %X %c %s %S(string in flash) %%
+ * with an optional '0' flag and field width, e.g. %3d %03d %04x. As with
+ * printf, fields are space padded unless the '0' flag is given.
+ * Arguments are int sized. The fmt_* append helpers skip format parsing
+ * altogether.
+ */ 
+
+
+#ifndef FMT_H_
+#define FMT_H_
+
+#include <stdarg.h>
+#include <stdint.h>
+#include "uart.h"
+
+typedef struct fmt_sink fmt_sink_t;
+
+struct fmt_sink {
+  void (*put)(fmt_sink_t *, char);
+};
+
+typedef struct {
+  fmt_sink_t sink;
+  uart_t *uart;
+} fmt_uart_t;
+
+fmt_sink_t *fmt_uart_init(fmt_uart_t *f, uart_t *uart);
+
+void fmt_vprintf(fmt_sink_t *out, const char *fmt, va_list ap);
+void fmt_printf(fmt_sink_t *out, const char *fmt, ...);
+void fmt_vprintf_P(fmt_sink_t *out, const char *fmt, va_list ap);
+void fmt_printf_P(fmt_sink_t *out, const char *fmt, ...);
+
+void fmt_char(fmt_sink_t *out, char c);
+void fmt_str(fmt_sink_t *out, const char *s);
+void fmt_str_P(fmt_sink_t *out, const char *s);
+void fmt_uint(fmt_sink_t *out, uint16_t v, uint8_t width, char pad);
+void fmt_int(fmt_sink_t *out, int16_t v, uint8_t width, char pad);
+void fmt_hex(fmt_sink_t *out, uint16_t v, uint8_t width, char pad, bool upper);
+
+#endif /* FMT_H_ */
@@ -7,9 +7,16 @@
  * Generic GPIO and GPIO pin interface
  */ 
 
+#include <util/atomic.h>
 #include "gpio.h"
 #include "atmega/bits_atmega.h"
 
+/*
+ * PORTx writes are read-modify-write and the BAM compare ISR rewrites
+ * whole ports, so they are done with interrupts off; otherwise a write
+ * from a task could put back port bits the ISR changed in between.
+ */
+
 gpio_pin_t gpio_pin_A[8] = {
   { .gpio = GPIOA_ADDRESS, .pin = 0, .val = unset	},
   { .gpio = GPIOA_ADDRESS, .pin = 1, .val = unset	},
@@ -96,7 +103,9 @@ gpio_pin_t * const GPIOD7 = &gpio_pin_D[7];
  * @return void
  */
 inline void gpio_pin_set_pin(gpio_pin_t *p) {
-  p->gpio->PORTx |= (1 << p->pin);
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    p->gpio->PORTx |= (1 << p->pin);
+  }
 }
 
 /**
@@ -105,16 +114,22 @@ inline void gpio_pin_set_pin(gpio_pin_t *p) {
  * @return void
  */
 inline void gpio_pin_unset_pin(gpio_pin_t *p) {
-  p->gpio->PORTx &= ~(1 << p->pin);
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    p->gpio->PORTx &= ~(1 << p->pin);
+  }
 }
 
 /**
  * Toggle gpio pin value
+ *
+ * Writing a one to PINx toggles that PORTx bit in a single store, a
+ * read-modify-write would toggle every pin that reads high.
+ *
  * @param p GPIO_pin object
  * @return void
  */
 inline void gpio_pin_toggle(gpio_pin_t *p) {
-  p->gpio->PINx |= (1 << p->pin);	
+  p->gpio->PINx = (1 << p->pin);
 }
 
 /**
@@ -138,10 +153,12 @@ void gpio_pin_set_direction(gpio_pin_t *p, gpio_direction d) {
  * @return void
  */
 void gpio_pin_set_value(gpio_pin_t *p, gpio_pinval v) {
-  if (v)
-    REG_SETBIT(p->gpio->PORTx, p->pin);
-  else
-    REG_CLRBIT(p->gpio->PORTx, p->pin);
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (v)
+      REG_SETBIT(p->gpio->PORTx, p->pin);
+    else
+      REG_CLRBIT(p->gpio->PORTx, p->pin);
+  }
 }
 
 /**
@@ -151,10 +168,12 @@ void gpio_pin_set_value(gpio_pin_t *p, gpio_pinval v) {
  * @return void
  */
 void gpio_pin_set_pullup(gpio_pin_t *p, gpio_pullup v) {
-  if (v)
-    REG_SETBIT(p->gpio->PORTx, p->pin);
-  else
-    REG_CLRBIT(p->gpio->PORTx, p->pin);
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (v)
+      REG_SETBIT(p->gpio->PORTx, p->pin);
+    else
+      REG_CLRBIT(p->gpio->PORTx, p->pin);
+  }
 }
 
 /**
@@ -242,7 +242,7 @@ static void *heap_remove_head(heap_t *heap) {
 /**
  * Heap class interface
  */
-heap_class_t Heap = {
+const ROM heap_class_t Heap = {
   .static_init = heap_static_init,
   .init = heap_init,
   .insert = heap_insert,
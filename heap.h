@@ -12,6 +12,7 @@
 #define HEAP_H_
 
 #include <stdbool.h>
+#include "types.h"
 
 #define STATIC_HEAP_SIZE 8
 
@@ -48,6 +49,6 @@ typedef struct {
   bool    (* const is_full)(const heap_t*);
 } heap_class_t;
 
-extern heap_class_t Heap;
+extern const ROM heap_class_t Heap;
 
 #endif /* HEAP_H_ */
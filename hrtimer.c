@@ -0,0 +1,204 @@
+/*
+ * hrtimer.c
+ *
+ * High resolution one-shot timers, a deadline sorted list served by the
+ * Timer1 compare A ISR
+ */ 
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "hrtimer.h"
+#include "timer.h"
+
+static list_t hrtimer_queue;
+static bool hrtimer_running = false;
+static bool hrtimer_servicing = false;
+
+static inline hrtimer_t *hrtimer_entry(list_t *lnode) {
+  return LIST_ENTRY(lnode, hrtimer_t, lnode);
+}
+
+/**
+ * Ticks until a deadline, negative once it has passed
+ * @param deadline timer ticks
+ * @param now timer ticks
+ * @return signed distance
+ */
+static inline int16_t hrtimer_left(uint16_t deadline, uint16_t now) {
+  return (int16_t)(deadline - now);
+}
+
+/**
+ * Start Timer1 in normal mode as a free running time base
+ *
+ * Safe to call more than once. Marks Timer1 initialized so a later
+ * timer_init from the PWM driver leaves it alone, and pwm_init refuses
+ * PWM1A and PWM1B from then on. Refuses in turn if the PWM driver got
+ * Timer1 first.
+ *
+ * @param void
+ * @return false if Timer1 already runs PWM1A or PWM1B
+ */
+bool hrtimer_init(void) {
+  timer16_atmega_reg_t *t1 = DEV_TIMER1->regs.t16;
+  bool result = true;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (hrtimer_running) {
+      // already ours
+    }
+    else if (DEV_TIMER1->initialized) {
+      result = false;
+    }
+    else {
+      List.init(&hrtimer_queue);
+      t1->TCCRxB = 0;
+      t1->TCCRxA = 0;
+      t1->TCCRxC = 0;
+      t1->TCNTx = 0;
+      *(DEV_TIMER1->regs.TIMSKx) = 0;
+      t1->TCCRxB = _BV(CS11); // /8
+      DEV_TIMER1->initialized = true;
+      hrtimer_running = true;
+    }
+  }
+  return result;
+}
+
+/**
+ * @param void
+ * @return true once hrtimer_init has taken Timer1
+ */
+bool hrtimer_active(void) {
+  return hrtimer_running;
+}
+
+/**
+ * @param void
+ * @return current Timer1 count
+ */
+uint16_t hrtimer_now(void) {
+  uint16_t now;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    now = DEV_TIMER1->regs.t16->TCNTx;
+  }
+  return now;
+}
+
+/**
+ * Fire every expired timer and program OCR1A for the next one
+ *
+ * Called with interrupts disabled. A deadline that slips past while OCR1A
+ * is written is caught by the re-check, so no timer waits a full wrap.
+ * A callback that rearms lands back in the queue this loop walks, so the
+ * nested hrtimer_start_at leaves the servicing to it. The task is only
+ * scheduled if it is not on a list already, a task woken twice before it
+ * runs is queued once.
+ *
+ * @param void
+ * @return void
+ */
+static void hrtimer_service(void) {
+  timer16_atmega_reg_t *t1 = DEV_TIMER1->regs.t16;
+
+  hrtimer_servicing = true;
+  TIMSK1 &= ~_BV(OCIE1A);
+  while (!List.isEmpty(&hrtimer_queue)) {
+    hrtimer_t *t = hrtimer_entry(hrtimer_queue.next);
+
+    if (hrtimer_left(t->deadline, t1->TCNTx) > 0) {
+      t1->OCRxA = t->deadline;
+      if (hrtimer_left(t->deadline, t1->TCNTx) > 0) {
+        TIMSK1 |= _BV(OCIE1A);
+        break;
+      }
+    }
+
+    List.remove(&t->lnode);
+    if (t->callback) t->callback(t);
+    if (t->task && List.isEmpty(task_list_node(t->task)))
+      Task.schedule(t->task, TASK_SCHED_IMMED);
+  }
+  hrtimer_servicing = false;
+}
+
+/**
+ * Attach what an expiring timer does
+ * @param t timer object owned by the caller
+ * @param callback run in ISR context on expiry, keep it short, may be NULL
+ * @param task scheduled immediately on expiry, may be NULL
+ * @param data for the caller, untouched here
+ * @return void
+ */
+void hrtimer_setup(hrtimer_t *t, hrtimer_fp callback, task_t *task, void *data) {
+  List.init(&t->lnode);
+  t->callback = callback;
+  t->task = task;
+  t->data = data;
+}
+
+/**
+ * Arm a timer for an absolute Timer1 count
+ *
+ * Rearming from the callback with deadline + period gives a pulse train
+ * without cumulative drift. A deadline up to half a wrap in the past
+ * fires at once, from this call with interrupts disabled. A pending
+ * timer is rearmed.
+ *
+ * @param t timer set up with hrtimer_setup
+ * @param deadline Timer1 count, at most HRTIMER_MAX_DELAY ahead of now
+ * @return false, leaving t alone, if Timer1 runs PWM
+ */
+bool hrtimer_start_at(hrtimer_t *t, uint16_t deadline) {
+  list_t *lnode;
+  if (!hrtimer_init()) return false;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    List.remove(&t->lnode);
+    t->deadline = deadline;
+
+    // keep the queue sorted, ties fire in arming order
+    for (lnode = hrtimer_queue.next; lnode != &hrtimer_queue; lnode = lnode->next)
+      if (hrtimer_left(hrtimer_entry(lnode)->deadline, deadline) > 0) break;
+    List.addAtRear(lnode, &t->lnode);
+
+    if (hrtimer_queue.next == &t->lnode && !hrtimer_servicing) {
+      TIFR1 = _BV(OCF1A);
+      hrtimer_service();
+    }
+  }
+  return true;
+}
+
+/**
+ * Arm a timer relative to now
+ * @param t timer set up with hrtimer_setup
+ * @param delay ticks from now, HRTIMER_US() converts from microseconds
+ * @return false if delay is above HRTIMER_MAX_DELAY or Timer1 runs PWM
+ */
+bool hrtimer_start(hrtimer_t *t, uint16_t delay) {
+  if (delay > HRTIMER_MAX_DELAY) return false;
+  return hrtimer_start_at(t, hrtimer_now() + delay);
+}
+
+/**
+ * Disarm a timer, nothing happens if it is not pending
+ * @param t timer
+ * @return void
+ */
+void hrtimer_cancel(hrtimer_t *t) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    List.remove(&t->lnode);
+  }
+}
+
+/**
+ * @param t timer
+ * @return true while t is armed
+ */
+bool hrtimer_pending(const hrtimer_t *t) {
+  return t->lnode.next != &t->lnode;
+}
+
+ISR(TIMER1_COMPA_vect) {
+  hrtimer_service();
+}
@@ -0,0 +1,57 @@
+/*
+ * hrtimer.h
+ *
+ * High resolution one-shot timers on Timer1
+ *
+ * Timer1 free runs at SYSCLOCK / HRTIMER_PRESCALE (1 MHz) and OCR1A is
+ * programmed for the earliest pending deadline. Deadlines are 16-bit
+ * timer ticks compared with wrap-around, so a timer can be at most
+ * HRTIMER_MAX_DELAY ticks (32 ms) out; anything longer belongs on the
+ * systick task queue.
+ *
+ * OCR1B stays free for the timed ADC scan, which shares the time base.
+ * Timer1 belongs to whoever takes it first: once this runs pwm_init and
+ * the wave functions return false for PWM1A and PWM1B, and after
+ * pwm_init on either of them hrtimer_init and the start calls return
+ * false.
+ */ 
+
+
+#ifndef HRTIMER_H_
+#define HRTIMER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "system.h"
+#include "list.h"
+#include "task.h"
+
+#define HRTIMER_PRESCALE 8
+#define HRTIMER_HZ (SYSCLOCK / HRTIMER_PRESCALE)
+#define HRTIMER_MAX_DELAY 0x7FFF
+
+// convert microseconds to timer ticks at compile time
+#define HRTIMER_US(us) ((uint16_t)((uint32_t)(us) * (HRTIMER_HZ / 1000) / 1000))
+
+typedef struct hrtimer_t hrtimer_t;
+
+typedef void (*hrtimer_fp)(hrtimer_t*);
+
+struct hrtimer_t {
+  list_t lnode;
+  uint16_t deadline;
+  hrtimer_fp callback; // runs in ISR context, may be NULL
+  task_t *task;        // scheduled immediately on expiry, may be NULL
+  void *data;
+};
+
+bool hrtimer_init(void);
+bool hrtimer_active(void);
+uint16_t hrtimer_now(void);
+void hrtimer_setup(hrtimer_t *t, hrtimer_fp callback, task_t *task, void *data);
+bool hrtimer_start(hrtimer_t *t, uint16_t delay);
+bool hrtimer_start_at(hrtimer_t *t, uint16_t deadline);
+void hrtimer_cancel(hrtimer_t *t);
+bool hrtimer_pending(const hrtimer_t *t);
+
+#endif /* HRTIMER_H_ */
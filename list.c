@@ -189,7 +189,7 @@ static inline list_t* list_find(const list_t *head, list_iter_predicate pred, co
 /**
  * Public Interface for List Class
  */
-const list_class_t const List = {
+const ROM list_class_t const List = {
   .init = list_init,
   .size = list_size,
   .isEmpty = list_isEmpty,
@@ -11,6 +11,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include "types.h"
 
 typedef struct list_t list_t;
 struct list_t {
@@ -35,7 +36,7 @@ typedef struct {
   void (*const eachIf)(list_t*, list_iter_callback, list_iter_predicate, const void*);
 } list_class_t;
 
-extern const list_class_t const List;
+extern const ROM list_class_t const List;
 
 
 #define LIST_FOR_EACH_SAFE(pos, tmp, head)                      \
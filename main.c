@@ -22,9 +22,8 @@ int main(void) {
   echo_init();
   producer_consumer_init();
 	
-  ADC_.start(ADC_CH0, 250);
-  ADC_.start(ADC_CH1, 125);
-  ADC_.start(ADC_CH2, 125);
+  // takes Timer1 as the hrtimer time base, pwm_init refuses PWM1A/1B after
+  ADC_.scan_rate((1 << ADC_CH0) | (1 << ADC_CH1) | (1 << ADC_CH2), 100);
 
   scheduler_run();
 }
@@ -7,6 +7,7 @@
  * Demo of the producer consumer problem using tasks/mutexes
  */ 
 
+#include <avr/pgmspace.h>
 #include "task.h"
 #include "task_mutex.h"
 #include "ring_buffer.h"
@@ -18,6 +19,9 @@ typedef struct {
   uint8_t value;
 } pc_data_t;
 
+#define PC_BUFFER_SIZE 128
+
+RING_BUFFER_STORAGE(uint8_t, pc_buffer_storage, PC_BUFFER_SIZE);
 static ring_buffer_t pc_buffer;
 static task_mutex_t pc_mutex;
 
@@ -28,7 +32,6 @@ static task_t *pc_consumer0_task;
 static task_t *pc_consumer1_task;
 static task_t *pc_consumer2_task;
 
-static task_t *pc_display_task;
 
 static pc_data_t pc_producer0_task_data;
 static pc_data_t pc_producer1_task_data;
@@ -61,14 +64,14 @@ static task_slice_result_t consumer_consume(task_t * task);
 /************************************************************************
  Task Slice Initialization for producer and consumers
 ************************************************************************/
-static const task_slice_callback_fp const pc_producer_task_slices[] = {
+static const ROM task_slice_callback_fp const pc_producer_task_slices[] = {
   producer_init,
   producer_produce,
   producer_get_control,
   producer_finalize
 };
 
-static const task_slice_callback_fp const pc_consumer_task_slices[] = {
+static const ROM task_slice_callback_fp const pc_consumer_task_slices[] = {
   consumer_init,
   consumer_get_control,
   consumer_finalize,
@@ -76,7 +79,7 @@ static const task_slice_callback_fp const pc_consumer_task_slices[] = {
 };
 
 // NOTE: consumer2 has a slightly different set of callbacks
-static const task_slice_callback_fp const pc_consumer2_task_slices[] = {
+static const ROM task_slice_callback_fp const pc_consumer2_task_slices[] = {
   consumer_init,
   consumer_get_control,
   consumer_finalize_variable, // <-- different finalization function
@@ -84,16 +87,14 @@ static const task_slice_callback_fp const pc_consumer2_task_slices[] = {
 };
 
 
-static task_slice_result_t pc_display(task_t *task);
-static const task_slice_callback_fp const pc_display_task_slices[] = {
-  pc_display
-};
+static void pc_display_producers(term_t *t, int r, void *data);
+static void pc_display_consumers(term_t *t, int r, void *data);
 
 /**
  * Initailize producer_consumer demo
  */ 
 void producer_consumer_init(void) {
-  Ringbuffer.init(&pc_buffer);
+  Ringbuffer.init(&pc_buffer, pc_buffer_storage, PC_BUFFER_SIZE);
   Mutex.init(&pc_mutex);
 
   // Note: It is effectively no extra work to add an extra producer
@@ -113,13 +114,14 @@ void producer_consumer_init(void) {
   Task.schedule(pc_consumer1_task, TASK_RESCHED);
   Task.schedule(pc_consumer2_task, TASK_RESCHED);
 
-  pc_display_task = Task.new(pc_display_task_slices, NULL, 500, true);
-  Task.schedule(pc_display_task, TASK_RESCHED);
+  // regions 0 and 2 are drawn by the terminal compositor
+  term_region_render(TERM0, 0, pc_display_producers, NULL);
+  term_region_render(TERM0, 2, pc_display_consumers, NULL);
 
-  // Ultimately, this demo sets up 6 tasks:
+  // Ultimately, this demo sets up 5 tasks:
   // 2 producer tasks
   // 3 consumer tasks
-  // 1 display tasks
+  // and 2 render callbacks for the terminal compositor
   // ALL of these must coordinate the resources in this file
 }
 
@@ -170,6 +172,10 @@ static task_slice_result_t producer_finalize(task_t * task) {
     result.next = PC_STATE_PRODUCER_PRODUCE;
     result.sched = TASK_RESCHED;
   }
+  else {
+    // sleep until a consumer makes room instead of spinning
+    result.sched = Ringbuffer.wait_space(&pc_buffer, 1, task);
+  }
 
   // assume that we have control of the lock at this point
   Mutex.unlock(&pc_mutex, task);
@@ -214,6 +220,10 @@ static task_slice_result_t consumer_finalize(task_t * task) {
     result.next = PC_STATE_CONSUMER_CONSUME;
     result.sched = TASK_SCHED_IMMED;
   }
+  else {
+    // sleep until a producer adds something instead of spinning
+    result.sched = Ringbuffer.wait_data(&pc_buffer, task);
+  }
 
   // assume that we have control of the lock at this point
   Mutex.unlock(&pc_mutex, task);
@@ -225,10 +235,10 @@ static task_slice_result_t consumer_finalize_variable(task_t * task) {
   task_slice_result_t result = { PC_STATE_CONSUMER_CONTROL, TASK_SCHED_IMMED };
 
   if (!Ringbuffer.empty(&pc_buffer)) {
-    if (Ringbuffer.size(&pc_buffer) >= RING_BUFFER_SIZE - 2) {
+    if (Ringbuffer.size(&pc_buffer) >= Ringbuffer.capacity(&pc_buffer) - 1) {
       Task.set_ticks(task, 75);
     }
-    else if (Ringbuffer.size(&pc_buffer) < RING_BUFFER_SIZE / 2) {
+    else if (Ringbuffer.size(&pc_buffer) < PC_BUFFER_SIZE / 2) {
       Task.set_ticks(task, PC_CONSUMER2_TICKS);
     }
 
@@ -240,6 +250,9 @@ static task_slice_result_t consumer_finalize_variable(task_t * task) {
     result.next = PC_STATE_CONSUMER_CONSUME;
     result.sched = TASK_SCHED_IMMED;
   }
+  else {
+    result.sched = Ringbuffer.wait_data(&pc_buffer, task);
+  }
 
   // assume that we have control of the lock at this point
   Mutex.unlock(&pc_mutex, task);
@@ -255,20 +268,19 @@ static task_slice_result_t consumer_consume(task_t * task) {
   return result;
 }
 
-static task_slice_result_t pc_display(task_t *task) {
-  task_slice_result_t result = { 0, TASK_RESCHED };
-  int rb_size = Ringbuffer.size(&pc_buffer);
-	
-  term_display_region(TERM0, 0, 0, "Producers       idx  val");
-  term_display_region(TERM0, 0, 1, "Producer 0 -- [%3d : %3d]", pc_producer0_task_data.index, pc_producer0_task_data.value);
-  term_display_region(TERM0, 0, 2, "Producer 1 -- [%3d : %3d]", pc_producer1_task_data.index, pc_producer1_task_data.value);
+static void pc_display_producers(term_t *t, int r, void *data) {
+  (void)data;
+  term_display_region_P(t, r, 0, PSTR("Producers       idx  val"));
+  term_display_region_P(t, r, 1, PSTR("Producer 0 -- [%3d : %3d]"), pc_producer0_task_data.index, pc_producer0_task_data.value);
+  term_display_region_P(t, r, 2, PSTR("Producer 1 -- [%3d : %3d]"), pc_producer1_task_data.index, pc_producer1_task_data.value);
 
-  term_display_region(TERM0, 0, 3, "Shared Queue Size [%3d/%3d]", rb_size, RING_BUFFER_SIZE-1);
-	
-  term_display_region(TERM0, 2, 0, "Consumers      idx   val");
-  term_display_region(TERM0, 2, 1, "Consumer 0 -- [%3d : %3d]", pc_consumer0_task_data.index, pc_consumer0_task_data.value);
-  term_display_region(TERM0, 2, 2, "Consumer 1 -- [%3d : %3d]", pc_consumer1_task_data.index, pc_consumer1_task_data.value);
-  term_display_region(TERM0, 2, 3, "Consumer 2 -- [%3d : %3d]", pc_consumer2_task_data.index, pc_consumer2_task_data.value);
+  term_display_region_P(t, r, 3, PSTR("Shared Queue Size [%3d/%3d]"), Ringbuffer.size(&pc_buffer), Ringbuffer.capacity(&pc_buffer));
+}
 
-  return result;
+static void pc_display_consumers(term_t *t, int r, void *data) {
+  (void)data;
+  term_display_region_P(t, r, 0, PSTR("Consumers      idx   val"));
+  term_display_region_P(t, r, 1, PSTR("Consumer 0 -- [%3d : %3d]"), pc_consumer0_task_data.index, pc_consumer0_task_data.value);
+  term_display_region_P(t, r, 2, PSTR("Consumer 1 -- [%3d : %3d]"), pc_consumer1_task_data.index, pc_consumer1_task_data.value);
+  term_display_region_P(t, r, 3, PSTR("Consumer 2 -- [%3d : %3d]"), pc_consumer2_task_data.index, pc_consumer2_task_data.value);
 }
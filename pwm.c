@@ -8,9 +8,11 @@
 #include <stdlib.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <util/atomic.h>
 #include "pwm.h"
 #include "timer.h"
+#include "hrtimer.h"
 
 /**
  * default pwm config for timer2
@@ -94,16 +96,52 @@ device_pwm_t * const PWM1B = &pwm_1B;
 device_pwm_t * const PWM2A = &pwm_2A;
 device_pwm_t * const PWM2B = &pwm_2B;
 
+static device_pwm_t * const pwm_devices[] = { &pwm_1A, &pwm_1B, &pwm_2A, &pwm_2B };
+#define PWM_DEVICES (sizeof(pwm_devices) / sizeof(pwm_devices[0]))
+
 // global flags to avoid having the timers initialized more than once
 
+/**
+ * @param pwm PWM device
+ * @return true if pwm sits on Timer1 and the hrtimer has taken it
+ */
+static inline bool pwm_timer_taken(device_pwm_t *pwm) {
+  return pwm->timer == DEV_TIMER1 && hrtimer_active();
+}
+
 /**
  * Initialize PWM driver
+ *
+ * PWM1A and PWM1B share Timer1 with the hrtimer service and the timed ADC
+ * scan; whichever initializes Timer1 first keeps it.
+ *
  * @param pwm PWM device to initialize
- * @return void
+ * @return false, leaving the pin alone, if the hrtimer owns the timer
  */
-void pwm_init(device_pwm_t *pwm) {
+bool pwm_init(device_pwm_t *pwm) {
+  uint32_t top;
+  if (pwm_timer_taken(pwm)) return false;
+  if (pwm->timer->is16bits)
+    top = pwm->TOP.p16 ? *(pwm->TOP.p16) : UINT16_MAX;
+  else
+    top = pwm->TOP.p8 ? *(pwm->TOP.p8) : UINT8_MAX;
+  // rounded up so duty 1023 lands exactly on TOP
+  pwm->scale = ((top << 16) + 1022) / 1023;
+
   *(pwm->ddr) |= _BV(pwm->ddr_pin);
   timer_init(pwm->timer, &pwm->config);
+  return true;
+}
+
+/**
+ * Scale a duty on [0..1023] to the counter range of pwm
+ * @param pwm PWM device
+ * @param duty duty cycle, clamped to 1023
+ * @return OCR value on [0..TOP]
+ */
+static inline uint16_t pwm_scale(device_pwm_t *pwm, uint16_t duty) {
+  if (duty > 1023) duty = 1023;
+  return ((uint32_t)duty * pwm->scale) >> 16;
 }
 
 /**
@@ -159,16 +197,289 @@ void pwm_set_duty_raw(device_pwm_t *pwm, uint16_t raw) {
  *
  */
 void pwm_set_duty(device_pwm_t *pwm, uint16_t duty) {
-  if (pwm->timer->is16bits) {
-    uint32_t top = pwm->TOP.p16 ? *(pwm->TOP.p16) : UINT16_MAX;
-    uint32_t scaled = ((uint32_t)duty * top) / 1023;
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-      *(pwm->ocrx.p16) = (register16_t)scaled;
+  pwm_set_OCRX(pwm, pwm_scale(pwm, duty));
+}
+
+/**
+ * Enable or disable the overflow interrupt of the timer driving pwm
+ * @param pwm PWM device
+ * @param on true to enable
+ * @return void
+ */
+static inline void pwm_overflow_irq(device_pwm_t *pwm, bool on) {
+  // TOIEn is bit 0 of every TIMSKn
+  if (on)
+    *(pwm->timer->regs.TIMSKx) |= _BV(TOIE1);
+  else
+    *(pwm->timer->regs.TIMSKx) &= ~_BV(TOIE1);
+}
+
+/************************************************************************/
+/* Batched Updates                                                      */
+/************************************************************************/
+
+/**
+ * Stage a duty cycle for the next pwm_commit
+ *
+ * The value is scaled here, with the multiplier computed by pwm_init, so
+ * the commit itself is only register writes.
+ *
+ * @param pwm PWM device
+ * @param duty Value to stage on range [0..1023]
+ * @return void
+ */
+void pwm_stage(device_pwm_t *pwm, uint16_t duty) {
+  pwm->stage = pwm_scale(pwm, duty);
+  pwm->stage_dirty = true;
+}
+
+/**
+ * Publish every staged duty at the next overflow of its timer
+ *
+ * All channels of one timer are written in the same overflow ISR and, as
+ * OCRnx is double buffered, switch together at the following BOTTOM.
+ * Timers 1 and 2 are not phase locked, so channels on different timers
+ * switch within one PWM period of each other. A committed channel stops
+ * its waveform.
+ *
+ * @param void
+ * @return void
+ */
+void pwm_commit(void) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    for (uint8_t i = 0; i < PWM_DEVICES; i++) {
+      device_pwm_t *pwm = pwm_devices[i];
+      if (!pwm->stage_dirty) continue;
+      pwm->commit = pwm->stage;
+      pwm->commit_pending = true;
+      pwm->stage_dirty = false;
+      pwm_overflow_irq(pwm, true);
+    }
+  }
+}
+
+/**
+ * @param void
+ * @return true until the last pwm_commit has reached the hardware
+ */
+bool pwm_commit_pending(void) {
+  for (uint8_t i = 0; i < PWM_DEVICES; i++)
+    if (pwm_devices[i]->commit_pending) return true;
+  return false;
+}
+
+/**
+ * Write a committed duty, from the overflow ISR
+ * @param pwm PWM device
+ * @return void
+ */
+static inline void pwm_commit_apply(device_pwm_t *pwm) {
+  if (!pwm->commit_pending) return;
+  pwm_set_OCRX(pwm, pwm->commit);
+  pwm->wave.running = false;
+  pwm->commit_pending = false;
+}
+
+/************************************************************************/
+/* Waveform Engine                                                      */
+/************************************************************************/
+
+const uint8_t pwm_sine_P[PWM_SINE_STEPS] PROGMEM = {
+  128, 140, 152, 165, 176, 188, 198, 208,
+  218, 226, 234, 240, 245, 250, 253, 254,
+  255, 254, 253, 250, 245, 240, 234, 226,
+  218, 208, 198, 188, 176, 165, 152, 140,
+  128, 115, 103,  90,  79,  67,  57,  47,
+   37,  29,  21,  15,  10,   5,   2,   1,
+    0,   1,   2,   5,  10,  15,  21,  29,
+   37,  47,  57,  67,  79,  90, 103, 115
+};
+
+/**
+ * Convert a step rate to timer overflows per step
+ * @param hz steps per second
+ * @return divider, at least 1
+ */
+static uint16_t pwm_wave_divider(uint16_t hz) {
+  uint32_t divider = hz ? PWM_OVERFLOW_HZ / hz : UINT16_MAX;
+  if (divider < 1) divider = 1;
+  if (divider > UINT16_MAX) divider = UINT16_MAX;
+  return divider;
+}
+
+/**
+ * Advance the waveform of a channel by one overflow
+ *
+ * Runs in the overflow ISR. OCRnx is double buffered in fast PWM mode, so
+ * the new duty takes effect cleanly at the next BOTTOM.
+ *
+ * @param pwm PWM device
+ * @return true while the waveform keeps running
+ */
+static inline bool pwm_wave_step(device_pwm_t *pwm) {
+  pwm_wave_t *w = &pwm->wave;
+  bool finished = false;
+  uint8_t out;
+
+  if (!w->running) return false;
+  if (--w->count) return true;
+  w->count = w->divider;
+
+  if (w->table) {
+    out = pgm_read_byte(&w->table[w->pos]);
+    if (++w->pos == w->len) {
+      w->pos = 0;
+      finished = w->loops && !--w->loops;
     }
   }
+  else if (w->restart) {
+    w->restart = false;
+    w->value = w->from;
+    out = w->from >> 8;
+  }
   else {
-    uint16_t top = pwm->TOP.p8 ? *(pwm->TOP.p8) : UINT8_MAX;
-    uint32_t scaled = ((uint32_t)duty * top) / 1023;
-    *(pwm->ocrx.p8) = (register_t)scaled;
+    // compare distances, the 8.8 position may not land on to exactly
+    uint16_t left = w->down ? w->value - w->to : w->to - w->value;
+    if (left <= w->stride) {
+      out = w->to >> 8;
+      finished = w->loops && !--w->loops;
+      w->restart = true;
+    }
+    else {
+      w->value = w->down ? w->value - w->stride : w->value + w->stride;
+      out = w->value >> 8;
+    }
+  }
+
+  pwm_set_OCRX(pwm, out);
+
+  if (finished) {
+    w->running = false;
+    if (w->done) w->done(pwm, w->done_data);
+  }
+  return w->running;
+}
+
+/**
+ * Start a waveform on a channel
+ * @param pwm PWM device
+ * @param hz step rate
+ * @param loops passes to play, 0 repeats until pwm_wave_stop
+ * @return void
+ */
+static void pwm_wave_start(device_pwm_t *pwm, uint16_t hz, uint8_t loops) {
+  pwm_wave_t *w = &pwm->wave;
+  w->divider = pwm_wave_divider(hz);
+  w->count = w->divider;
+  w->loops = loops;
+  w->running = true;
+  pwm_overflow_irq(pwm, true);
+}
+
+/**
+ * Play a PROGMEM table of raw 8-bit duty values on a channel
+ *
+ * The timer overflow ISR writes the next entry every PWM_OVERFLOW_HZ / hz
+ * overflows, so the waveform runs at hardware rate without any task.
+ *
+ * @param pwm PWM device, must have been initialized with pwm_init
+ * @param table duty values in PROGMEM, e.g. pwm_sine_P
+ * @param len entries in table
+ * @param hz entries per second, PWM_OVERFLOW_HZ at most
+ * @param loops passes over the table, 0 repeats until pwm_wave_stop
+ * @return false, leaving the channel alone, if table is NULL or empty or
+ *         the hrtimer owns the timer
+ */
+bool pwm_wave_table_P(device_pwm_t *pwm, const uint8_t *table, uint8_t len,
+                      uint16_t hz, uint8_t loops) {
+  if (!table || len == 0 || pwm_timer_taken(pwm)) return false;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    pwm_wave_t *w = &pwm->wave;
+    w->table = table;
+    w->len = len;
+    w->pos = 0;
+    pwm_wave_start(pwm, hz, loops);
+  }
+  return true;
+}
+
+/**
+ * Ramp the raw 8-bit duty of a channel linearly between two values
+ *
+ * The duty is set to from immediately and reaches to after steps steps.
+ * With loops other than 1 the step after to writes from exactly and the
+ * ramp starts over, i.e. a sawtooth.
+ *
+ * @param pwm PWM device, must have been initialized with pwm_init
+ * @param from starting duty
+ * @param to final duty
+ * @param steps steps to get from from to to, at least 1
+ * @param hz steps per second, PWM_OVERFLOW_HZ at most
+ * @param loops ramps to run, 0 repeats until pwm_wave_stop
+ * @return false, leaving the channel alone, if the hrtimer owns the timer
+ */
+bool pwm_wave_ramp(device_pwm_t *pwm, uint8_t from, uint8_t to,
+                   uint8_t steps, uint16_t hz, uint8_t loops) {
+  if (pwm_timer_taken(pwm)) return false;
+  if (!steps) steps = 1;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    pwm_wave_t *w = &pwm->wave;
+    w->table = NULL;
+    w->from = (uint16_t)from << 8;
+    w->to = (uint16_t)to << 8;
+    w->value = w->from;
+    w->down = to < from;
+    // in 32 bits, |to - from| * 256 does not fit a 16-bit int
+    w->stride = ((uint32_t)(w->down ? from - to : to - from) << 8) / steps;
+    w->restart = false;
+    pwm_set_OCRX(pwm, from);
+    pwm_wave_start(pwm, hz, loops);
+  }
+  return true;
+}
+
+/**
+ * Set the completion callback of a channel
+ * @param pwm PWM device
+ * @param done called from the overflow ISR when a waveform with a loop
+ *        count ends, NULL for none
+ * @param data passed to done
+ * @return void
+ */
+void pwm_wave_on_done(device_pwm_t *pwm, pwm_wave_done_fp done, void *data) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    pwm->wave.done = done;
+    pwm->wave.done_data = data;
   }
 }
+
+/**
+ * Stop the waveform of a channel, leaving the duty where it is
+ * @param pwm PWM device
+ * @return void
+ */
+void pwm_wave_stop(device_pwm_t *pwm) {
+  pwm->wave.running = false;
+}
+
+/**
+ * @param pwm PWM device
+ * @return true while a waveform is playing on pwm
+ */
+bool pwm_wave_running(device_pwm_t *pwm) {
+  return pwm->wave.running;
+}
+
+ISR(TIMER1_OVF_vect) {
+  pwm_commit_apply(&pwm_1A);
+  pwm_commit_apply(&pwm_1B);
+  if (!(pwm_wave_step(&pwm_1A) | pwm_wave_step(&pwm_1B)))
+    pwm_overflow_irq(&pwm_1A, false);
+}
+
+ISR(TIMER2_OVF_vect) {
+  pwm_commit_apply(&pwm_2A);
+  pwm_commit_apply(&pwm_2B);
+  if (!(pwm_wave_step(&pwm_2A) | pwm_wave_step(&pwm_2B)))
+    pwm_overflow_irq(&pwm_2A, false);
+}
@@ -12,8 +12,37 @@
 #include <stdint.h>
 #include "types.h"
 #include "timer.h"
+#include "system.h"
 
+// timers 1 and 2 run 8-bit fast PWM without prescaler
+#define PWM_OVERFLOW_HZ (SYSCLOCK / 256)
+
+typedef struct device_pwm_t device_pwm_t;
+
+typedef void (*pwm_wave_done_fp)(device_pwm_t*, void*);
+
+/**
+ * Waveform engine state, stepped from the timer overflow ISR
+ */
 typedef struct {
+  const uint8_t *table;    // PROGMEM duty table, NULL for a ramp
+  uint8_t len;
+  uint8_t pos;
+  uint16_t value;          // ramp position, 8.8 fixed point
+  uint16_t from;
+  uint16_t to;
+  uint16_t stride;         // ramp step magnitude, 8.8 fixed point
+  bool down;               // ramp direction
+  bool restart;            // next ramp step starts the pass again at from
+  uint16_t divider;        // overflows per step
+  uint16_t count;
+  uint8_t loops;           // passes left, 0 repeats forever
+  pwm_wave_done_fp done;   // called in ISR context when the wave ends
+  void *done_data;
+  volatile bool running;
+} pwm_wave_t;
+
+struct device_pwm_t {
   char ddr_pin;
   register_t *ddr;
   register_ptr_t ocrx;
@@ -21,12 +50,35 @@ typedef struct {
 
   timer_atmega_regs_t config;
   timer_t *timer;
-} device_pwm_t;
+  pwm_wave_t wave;
 
-void pwm_init(device_pwm_t * const);
+  uint32_t scale;               // duty to OCR multiplier, TOP * 2^16 / 1023
+  uint16_t stage;               // scaled duty waiting for pwm_commit
+  bool stage_dirty;
+  uint16_t commit;              // scaled duty waiting for the next overflow
+  volatile bool commit_pending;
+};
+
+bool pwm_init(device_pwm_t * const);
 void pwm_set_duty(device_pwm_t * const pwm, uint16_t duty);
 void pwm_set_duty_raw(device_pwm_t * const pwm, uint16_t raw);
 
+void pwm_stage(device_pwm_t *pwm, uint16_t duty);
+void pwm_commit(void);
+bool pwm_commit_pending(void);
+
+bool pwm_wave_table_P(device_pwm_t *pwm, const uint8_t *table, uint8_t len,
+                      uint16_t hz, uint8_t loops);
+bool pwm_wave_ramp(device_pwm_t *pwm, uint8_t from, uint8_t to,
+                   uint8_t steps, uint16_t hz, uint8_t loops);
+void pwm_wave_on_done(device_pwm_t *pwm, pwm_wave_done_fp done, void *data);
+void pwm_wave_stop(device_pwm_t *pwm);
+bool pwm_wave_running(device_pwm_t *pwm);
+
+// one period of a sine, 64 steps over the full 8-bit duty range
+#define PWM_SINE_STEPS 64
+extern const uint8_t pwm_sine_P[PWM_SINE_STEPS];
+
 extern device_pwm_t * const PWM0A;
 extern device_pwm_t * const PWM0B;
 extern device_pwm_t * const PWM1A;
@@ -4,20 +4,52 @@
  * Created: 7/8/2013 8:55:45 PM
  *  Author: Greg Cook
  *
- * This implementation maintains an empty slot between end and start,
- * so there are only SIZE-1 buffer slots.
+ * Byte specialization of the generic ring buffer, wrapped in the
+ * Ringbuffer class. This implementation maintains an empty slot between
+ * end and start, so there are only SIZE-1 buffer slots. Insert is the
+ * producer side and remove is the consumer side; one of each may run
+ * concurrently (e.g. task and ISR) without locking.
  */ 
 
 #include "ring_buffer.h"
 
+/**
+ * Reschedule every task waiting on a ring buffer wait list
+ *
+ * Called from the generic ring buffer when space or data shows up, which
+ * may be in ISR context. Woken tasks re-check the buffer when they run.
+ *
+ * @param waiting Wait list (readers or writers) of a ring buffer
+ * @return void
+ */
+void ring_buffer_notify(list_t *waiting) {
+  list_t *lnode;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    while ((lnode = List.removeFront(waiting))) {
+      Task.schedule(task_list_entry(lnode), TASK_SCHED_IMMED);
+    }
+  }
+}
+
 /**
  * Initialize Ring Buffer
  * @param rb Ring Buffer object
+ * @param storage Caller supplied element storage
+ * @param size Number of slots in storage, power of two up to 256
  * @return void
  */
-static void ringbuffer_init(ring_buffer_t *rb) {
-  rb->start = 0;
-  rb->end = 0;
+static void ringbuffer_init(ring_buffer_t *rb, uint8_t *storage, uint16_t size) {
+  ring_buffer_init(rb, storage, size);
+}
+
+/**
+ * Set the policy used when inserting into a full Ring Buffer
+ * @param rb Ring Buffer object
+ * @param policy RING_BUFFER_DROP_NEWEST or RING_BUFFER_OVERWRITE_OLDEST
+ * @return void
+ */
+static void ringbuffer_set_policy(ring_buffer_t *rb, ring_buffer_policy_t policy) {
+  ring_buffer_set_policy(rb, policy);
 }
 
 /**
@@ -26,7 +58,7 @@ static void ringbuffer_init(ring_buffer_t *rb) {
  * @return true if rb is full
  */
 static inline bool ringbuffer_isFull(const ring_buffer_t *rb) {
-  return (((rb->end + 1) % RING_BUFFER_SIZE) == rb->start);
+  return ring_buffer_full(rb);
 }
 
 /**
@@ -35,7 +67,7 @@ static inline bool ringbuffer_isFull(const ring_buffer_t *rb) {
  * @return true if rb is empty
  */
 static inline bool ringbuffer_isEmpty(const ring_buffer_t *rb) {
-  return (rb->start == rb->end);
+  return ring_buffer_empty(rb);
 }
 
 /**
@@ -44,7 +76,7 @@ static inline bool ringbuffer_isEmpty(const ring_buffer_t *rb) {
  * @return count of elements remaining in rb
  */
 static inline uint8_t ringbuffer_remainder(const ring_buffer_t *rb) {
-  return (rb->start + RING_BUFFER_SIZE - rb->end) % RING_BUFFER_SIZE;
+  return ring_buffer_remainder(rb);
 }
 
 /**
@@ -57,44 +89,41 @@ static inline uint8_t ringbuffer_remainder(const ring_buffer_t *rb) {
  * @return true if rb remainder is too close
  */
 static inline bool ringbuffer_almost_full(const ring_buffer_t *rb) {
-  return (ringbuffer_remainder(rb) >= RING_BUFFER_TOO_CLOSE);
+  return (ringbuffer_remainder(rb) < RING_BUFFER_TOO_CLOSE);
 }
 
 /**
  * Inserts new element into the Ring Buffer. May block if Ring buffer is full.
  *
  * Blocking depends on some other asynchronous event to take control of the
- * processor and empty the Ring Buffer. Be careful about using this in anger.
+ * processor and empty the Ring Buffer. Be careful about using this in anger,
+ * tasks should use insert_wait instead.
  *
  * @param rb Ring Buffer object
  * @param c Element to insert
- * @param block If true, block when Ring Buffer is full, otherwise overwrite
- * @return void
+ * @param block If true, block when Ring Buffer is full, otherwise apply the
+ *        buffer's full policy (drop newest or overwrite oldest)
+ * @return false if c was dropped
  */
-static inline void ringbuffer_insert_element(ring_buffer_t *rb, char c, bool block) {
+static inline bool ringbuffer_insert_element(ring_buffer_t *rb, char c, bool block) {
   while (block && ringbuffer_isFull(rb)) ; // block until ring buffer is not full
 
-  rb->buffer[rb->end] = c;
-  // do something convoluted to avoid concurrency problems
-  // avoid possibility of ISR erroneously finding buffer empty when full
-  if (ringbuffer_isFull(rb))
-    rb->start = (rb->start + 1 ) % RING_BUFFER_SIZE;
-
-  rb->end = (rb->end + 1 ) % RING_BUFFER_SIZE;
+  return ring_buffer_put(rb, c);
 }
 
 /**
- * Copy entire string into Ring buffer
- * Not actually used anywhere, as far as I know
+ * Copy entire string into Ring buffer, blocking until all of it fits
  * @param rb Ring Buffer object
  * @param s String to copy
  * @return void
  */
 static void ringbuffer_insert_string(ring_buffer_t * restrict rb, const char * restrict s) {
-  const char *p = s;
-  while (*p) {
-    ringbuffer_insert_element(rb, *p, true);
-    p++;
+  const uint8_t *p = (const uint8_t *)s;
+  size_t len = strlen(s);
+  while (len) {
+    uint8_t n = ring_buffer_write(rb, p, len > UINT8_MAX ? UINT8_MAX : len);
+    p += n;
+    len -= n;
   }
 }
 
@@ -106,31 +135,181 @@ static void ringbuffer_insert_string(ring_buffer_t * restrict rb, const char * r
  *       Check First.
  */
 static char ringbuffer_extract_element(ring_buffer_t *rb) {
-  char c = rb->buffer[rb->start];
-  rb->start = (rb->start + 1 ) % RING_BUFFER_SIZE;
-  return c;	
+  return ring_buffer_get(rb);
 }
 
 /**
  * Calculates the used size of the ring buffer. 
  *
  * This is the inverse operation of remainder. That is 
- * Size + Remainder = RING_BUFFER_SIZE.
+ * Size + Remainder = Capacity.
  *
  * @param rb Ring Buffer object
  * @return number of elements occupied in rb
  */
 static uint8_t ringbuffer_size(const ring_buffer_t *rb) {
-  return (RING_BUFFER_SIZE + rb->end - rb->start) % RING_BUFFER_SIZE;
+  return ring_buffer_size(rb);
+}
+
+/**
+ * Number of elements lost to the full buffer policy (wraps)
+ * @param rb Ring Buffer object
+ * @return drop count of rb
+ */
+static uint8_t ringbuffer_drops(const ring_buffer_t *rb) {
+  return ring_buffer_drops(rb);
+}
+
+/**
+ * Number of usable slots in the Ring Buffer (storage size - 1)
+ * @param rb Ring Buffer object
+ * @return capacity of rb
+ */
+static uint8_t ringbuffer_capacity(const ring_buffer_t *rb) {
+  return ring_buffer_capacity(rb);
+}
+
+/**
+ * Get the contiguous free region at the producer end
+ * @param rb Ring Buffer object
+ * @param span Set to the first free slot
+ * @return number of slots that may be written at span
+ */
+static uint8_t ringbuffer_write_span(ring_buffer_t *rb, uint8_t **span) {
+  return ring_buffer_write_span(rb, span);
+}
+
+/**
+ * Publish elements written into a span from write_span
+ * @param rb Ring Buffer object
+ * @param n Number of elements written
+ * @return void
+ */
+static void ringbuffer_commit(ring_buffer_t *rb, uint8_t n) {
+  ring_buffer_commit(rb, n);
+}
+
+/**
+ * Get the contiguous filled region at the consumer end
+ * @param rb Ring Buffer object
+ * @param span Set to the oldest element
+ * @return number of elements that may be read at span
+ */
+static uint8_t ringbuffer_read_span(ring_buffer_t *rb, const uint8_t **span) {
+  return ring_buffer_read_span(rb, span);
+}
+
+/**
+ * Free elements read from a span from read_span
+ * @param rb Ring Buffer object
+ * @param n Number of elements consumed
+ * @return void
+ */
+static void ringbuffer_release(ring_buffer_t *rb, uint8_t n) {
+  ring_buffer_release(rb, n);
+}
+
+/**
+ * Copy a block into the Ring Buffer, at most two memcpy calls
+ * @param rb Ring Buffer object
+ * @param src Data to copy
+ * @param n Number of bytes in src
+ * @return number of bytes copied, less than n if rb filled up
+ */
+static uint8_t ringbuffer_write(ring_buffer_t *rb, const uint8_t *src, uint8_t n) {
+  return ring_buffer_write(rb, src, n);
+}
+
+/**
+ * Copy a block out of the Ring Buffer, at most two memcpy calls
+ * @param rb Ring Buffer object
+ * @param dst Destination
+ * @param n Maximum number of bytes to copy
+ * @return number of bytes copied, less than n if rb ran empty or the
+ *         producer overwrote the bytes being copied
+ */
+static uint8_t ringbuffer_read(ring_buffer_t *rb, uint8_t *dst, uint8_t n) {
+  return ring_buffer_read(rb, dst, n);
+}
+
+/**
+ * Park a producer task until there is room in the Ring Buffer
+ *
+ * The task is rescheduled once at least n slots are free. Returns
+ * TASK_SCHED_IMMED without parking if there already is room.
+ *
+ * @param rb Ring Buffer object
+ * @param n Number of free slots needed
+ * @param task Task to park
+ * @return TASK_WAIT if task was parked
+ */
+static task_sched_t ringbuffer_wait_space(ring_buffer_t *rb, uint8_t n, task_t *task) {
+  return ring_buffer_wait_space(rb, n, task);
+}
+
+/**
+ * Park a consumer task until the Ring Buffer has data
+ * @param rb Ring Buffer object
+ * @param task Task to park
+ * @return TASK_WAIT if task was parked
+ */
+static task_sched_t ringbuffer_wait_data(ring_buffer_t *rb, task_t *task) {
+  return ring_buffer_wait_data(rb, task);
+}
+
+/**
+ * Insert element from a task without spinning on a full buffer
+ *
+ * Use this instead of insert(..., true) from task context. On TASK_WAIT
+ * nothing was inserted; return TASK_WAIT from the slice and retry the
+ * insert when the task runs again.
+ *
+ * @param rb Ring Buffer object
+ * @param c Element to insert
+ * @param task Calling task
+ * @return TASK_SCHED_IMMED if c was inserted, TASK_WAIT if task was parked
+ */
+static task_sched_t ringbuffer_insert_wait(ring_buffer_t *rb, char c, task_t *task) {
+  task_sched_t result = ring_buffer_wait_space(rb, 1, task);
+  if (result != TASK_WAIT)
+    ring_buffer_put(rb, c);
+  return result;
+}
+
+/**
+ * Remove element from a task, parking the task while the buffer is empty
+ * @param rb Ring Buffer object
+ * @param c Set to the removed element
+ * @param task Calling task
+ * @return TASK_SCHED_IMMED if c was set, TASK_WAIT if task was parked
+ */
+static task_sched_t ringbuffer_remove_wait(ring_buffer_t *rb, char *c, task_t *task) {
+  task_sched_t result = ring_buffer_wait_data(rb, task);
+  if (result != TASK_WAIT)
+    *c = ring_buffer_get(rb);
+  return result;
 }
 
-const ringbuffer_class_t const Ringbuffer = {
+const ROM ringbuffer_class_t const Ringbuffer = {
   .init = ringbuffer_init,
   .full = ringbuffer_isFull,
   .empty = ringbuffer_isEmpty,
   .almost_full = ringbuffer_almost_full,
+  .set_policy = ringbuffer_set_policy,
   .insert = ringbuffer_insert_element,
   .insert_string = ringbuffer_insert_string,
   .remove = ringbuffer_extract_element,
-  .size = ringbuffer_size
+  .size = ringbuffer_size,
+  .capacity = ringbuffer_capacity,
+  .drops = ringbuffer_drops,
+  .write_span = ringbuffer_write_span,
+  .commit = ringbuffer_commit,
+  .read_span = ringbuffer_read_span,
+  .release = ringbuffer_release,
+  .write = ringbuffer_write,
+  .read = ringbuffer_read,
+  .wait_space = ringbuffer_wait_space,
+  .wait_data = ringbuffer_wait_data,
+  .insert_wait = ringbuffer_insert_wait,
+  .remove_wait = ringbuffer_remove_wait
 };
@@ -3,38 +3,385 @@
  *
  * Created: 7/8/2013 8:51:41 PM
  *  Author: Greg Cook
- */ 
+ *
+ * Generic power-of-two ring buffer with caller supplied storage.
+ *
+ * RING_BUFFER_DECLARE(name, elem_t, index_t) specializes the ring buffer
+ * for an element type and an index type and generates name_t along with
+ * static inline name_xxx() accessors. Storage size must be a power of two
+ * so that wrapping is a mask instead of a modulus. One slot is always kept
+ * empty between end and start, so a buffer of SIZE slots holds SIZE-1
+ * elements.
+ *
+ * uint8_t indices handle storage up to 256 slots, uint16_t indices handle
+ * storage up to 64K slots.
+ *
+ * Single producer, single consumer: the producer only ever writes end and
+ * drops, the consumer only ever writes start and drops_seen. A producer in
+ * an ISR and a consumer in a task (or the other way around) need no
+ * critical section. With uint16_t indices the other side's index is loaded
+ * with interrupts held off for the two byte read, nothing more.
+ *
+ * When the buffer is full the policy decides what happens to a new element:
+ *   RING_BUFFER_DROP_NEWEST      the new element is discarded
+ *   RING_BUFFER_OVERWRITE_OLDEST the oldest element is discarded
+ * Either way drops is incremented. Overwrite is done without the producer
+ * touching start: the producer writes into the spare slot, then advances
+ * end and bumps drops together with interrupts held off, and the consumer
+ * notices drops != drops_seen and skips start forward to the oldest
+ * surviving element before it reads.
+ */
 
 #ifndef RING_BUFFER_H_
 #define RING_BUFFER_H_
 
+#include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#include <util/atomic.h>
+#include "list.h"
+#include "task.h"
 
-#define RING_BUFFER_SIZE ((uint8_t)128)
 #define RING_BUFFER_TOO_CLOSE ((uint8_t)16)
 
-// Careful there, optimizing cowboy....
-// If you use any bigger size, you are
-// going to have troubles unless you use bigger
-// data types.
-typedef struct {
-  uint8_t start;
-  uint8_t end;
-  uint8_t buffer[RING_BUFFER_SIZE];
-} ring_buffer_t;
+#define RING_BUFFER_IS_POW2(n) ((n) && !((n) & ((n) - 1)))
+
+/**
+ * Keep the compiler from moving buffer accesses across index updates
+ */
+#define RING_BUFFER_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+
+/**
+ * Load an index owned by the other side of the buffer. Single byte loads
+ * are atomic on AVR, wider ones are not.
+ */
+#define RING_BUFFER_LOAD(t, v) ({                                       \
+      t __v;                                                            \
+      if (sizeof(v) == 1) __v = (v);                                    \
+      else ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { __v = (v); }             \
+      __v; })
+
+typedef enum {
+  RING_BUFFER_DROP_NEWEST,
+  RING_BUFFER_OVERWRITE_OLDEST
+} ring_buffer_policy_t;
+
+void ring_buffer_notify(list_t *waiting);
+
+/**
+ * Declare statically allocated storage for a ring buffer
+ *
+ * @param elem_t Element type
+ * @param var Name of the storage array
+ * @param size Number of slots, must be a power of two
+ */
+#define RING_BUFFER_STORAGE(elem_t, var, size)                          \
+  _Static_assert(RING_BUFFER_IS_POW2(size),                             \
+                 #var " size must be a power of two");                  \
+  static elem_t var[size]
+
+/**
+ * Specialize a ring buffer for element type elem_t and index type index_t
+ *
+ * Generates the following for name:
+ *   name_t                        ring buffer object
+ *   name_init(rb, storage, size)  attach storage of size slots (power of two)
+ *   name_set_policy(rb, policy)   full buffer policy (default DROP_NEWEST)
+ *   name_capacity(rb)             usable slots (size - 1)
+ *   name_full(rb)                 true if no free slots
+ *   name_empty(rb)                true if no elements
+ *   name_size(rb)                 number of elements
+ *   name_remainder(rb)            number of free slots
+ *   name_drops(rb)                elements lost to the full buffer policy
+ *   name_put(rb, e)               producer: insert e, false if e was dropped
+ *   name_peek(rb)                 consumer: next element, not removed
+ *   name_get(rb)                  consumer: remove next element
+ *   name_write_span(rb, &p)       producer: contiguous free slots at p
+ *   name_commit(rb, n)            producer: publish n elements filled at p
+ *   name_read_span(rb, &p)        consumer: contiguous elements at p
+ *   name_release(rb, n)           consumer: free n elements read from p
+ *   name_write(rb, src, n)        producer: copy in up to n, returns count
+ *   name_read(rb, dst, n)         consumer: copy out up to n, returns count,
+ *                                 short if the producer lapped the copy
+ *
+ *   name_wait_space(rb, n, task)  producer: TASK_WAIT and park task until
+ *                                 n slots are free, else TASK_SCHED_IMMED
+ *                                 (n above capacity waits for an empty
+ *                                 buffer)
+ *                                 (with several writers parked they all
+ *                                 wake at the smallest n, the others call
+ *                                 wait_space again)
+ *   name_wait_data(rb, task)      consumer: TASK_WAIT and park task until
+ *                                 data arrives, else TASK_SCHED_IMMED
+ *
+ * Spans let the caller fill or parse buffer memory in place. A span ends
+ * at the wrap, so a full transfer takes at most two acquire/commit rounds;
+ * write and read do exactly that with memcpy. Bulk writes never drop or
+ * overwrite, they copy what fits.
+ *
+ * peek and get do not check for empty, check first. Overwrite-oldest
+ * tracks laps with drops, so the consumer has to run at least once every
+ * 2^(bits in index_t) drops.
+ */
+#define RING_BUFFER_DECLARE(name, elem_t, index_t)                      \
+  typedef struct {                                                      \
+    volatile index_t start;       /* consumer */                        \
+    volatile index_t drops_seen;  /* consumer */                        \
+    volatile index_t end;         /* producer */                        \
+    volatile index_t drops;       /* producer */                        \
+    index_t mask;                                                       \
+    index_t wake_space;                                                 \
+    ring_buffer_policy_t policy;                                        \
+    elem_t *buffer;                                                     \
+    list_t readers;                                                     \
+    list_t writers;                                                     \
+  } name ## _t;                                                         \
+                                                                        \
+  static inline void name ## _init(name ## _t *rb, elem_t *storage,     \
+                                   uint32_t size) {                     \
+    assert(RING_BUFFER_IS_POW2(size) && "Size is not a power of two");  \
+    assert((size - 1) <= (index_t)~(index_t)0 && "Size too big");       \
+    rb->buffer = storage;                                               \
+    rb->mask = (index_t)(size - 1);                                     \
+    rb->policy = RING_BUFFER_DROP_NEWEST;                               \
+    rb->start = 0;                                                      \
+    rb->drops_seen = 0;                                                 \
+    rb->end = 0;                                                        \
+    rb->drops = 0;                                                      \
+    rb->wake_space = 1;                                                 \
+    List.init(&rb->readers);                                            \
+    List.init(&rb->writers);                                            \
+  }                                                                     \
+                                                                        \
+  static inline void name ## _set_policy(name ## _t *rb,                \
+                                         ring_buffer_policy_t policy) { \
+    rb->policy = policy;                                                \
+  }                                                                     \
+                                                                        \
+  static inline index_t name ## _capacity(const name ## _t *rb) {       \
+    return rb->mask;                                                    \
+  }                                                                     \
+                                                                        \
+  static inline bool name ## _lapped(const name ## _t *rb) {            \
+    return (rb->policy == RING_BUFFER_OVERWRITE_OLDEST &&               \
+            RING_BUFFER_LOAD(index_t, rb->drops) !=                     \
+            RING_BUFFER_LOAD(index_t, rb->drops_seen));                 \
+  }                                                                     \
+                                                                        \
+  static inline bool name ## _full(const name ## _t *rb) {              \
+    index_t end = RING_BUFFER_LOAD(index_t, rb->end);                   \
+    return ((((index_t)(end + 1) & rb->mask) ==                         \
+             RING_BUFFER_LOAD(index_t, rb->start)) || name ## _lapped(rb)); \
+  }                                                                     \
+                                                                        \
+  static inline bool name ## _empty(const name ## _t *rb) {             \
+    return (RING_BUFFER_LOAD(index_t, rb->start) ==                     \
+            RING_BUFFER_LOAD(index_t, rb->end) && !name ## _lapped(rb)); \
+  }                                                                     \
+                                                                        \
+  static inline index_t name ## _size(const name ## _t *rb) {           \
+    if (name ## _lapped(rb)) return rb->mask;                           \
+    return (index_t)(RING_BUFFER_LOAD(index_t, rb->end) -               \
+                     RING_BUFFER_LOAD(index_t, rb->start)) & rb->mask;  \
+  }                                                                     \
+                                                                        \
+  static inline index_t name ## _remainder(const name ## _t *rb) {      \
+    return rb->mask - name ## _size(rb);                                \
+  }                                                                     \
+                                                                        \
+  static inline index_t name ## _drops(const name ## _t *rb) {          \
+    return RING_BUFFER_LOAD(index_t, rb->drops);                        \
+  }                                                                     \
+                                                                        \
+  static inline void name ## _wake_readers(name ## _t *rb) {            \
+    if (rb->readers.next != &rb->readers)                               \
+      ring_buffer_notify(&rb->readers);                                 \
+  }                                                                     \
+                                                                        \
+  static inline void name ## _wake_writers(name ## _t *rb) {            \
+    if (rb->writers.next != &rb->writers &&                             \
+        name ## _remainder(rb) >= rb->wake_space)                       \
+      ring_buffer_notify(&rb->writers);                                 \
+  }                                                                     \
+                                                                        \
+  static inline bool name ## _put(name ## _t *rb, elem_t e) {           \
+    index_t end = rb->end;                                              \
+    bool full = name ## _full(rb);                                      \
+    if (full && rb->policy == RING_BUFFER_DROP_NEWEST) {                \
+      rb->drops = rb->drops + 1;                                        \
+      return false;                                                     \
+    }                                                                   \
+    rb->buffer[end] = e;                                                \
+    RING_BUFFER_BARRIER();                                              \
+    if (full) {                                                         \
+      /* a consumer resyncing between the two would see it empty */     \
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {                               \
+        rb->end = (index_t)(end + 1) & rb->mask;                        \
+        rb->drops = rb->drops + 1;                                      \
+      }                                                                 \
+    }                                                                   \
+    else                                                                \
+      rb->end = (index_t)(end + 1) & rb->mask;                          \
+    name ## _wake_readers(rb);                                          \
+    return true;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline void name ## _resync(name ## _t *rb) {                  \
+    index_t drops, end;                                                 \
+    do {                                                                \
+      drops = RING_BUFFER_LOAD(index_t, rb->drops);                     \
+      end = RING_BUFFER_LOAD(index_t, rb->end);                         \
+    } while (drops != RING_BUFFER_LOAD(index_t, rb->drops));            \
+    rb->start = (index_t)(end + 1) & rb->mask;                          \
+    rb->drops_seen = drops;                                             \
+  }                                                                     \
+                                                                        \
+  static inline elem_t name ## _peek(name ## _t *rb) {                  \
+    if (name ## _lapped(rb)) name ## _resync(rb);                       \
+    return rb->buffer[rb->start];                                       \
+  }                                                                     \
+                                                                        \
+  static inline elem_t name ## _get(name ## _t *rb) {                   \
+    index_t start;                                                      \
+    elem_t e;                                                           \
+    do {                                                                \
+      if (name ## _lapped(rb)) name ## _resync(rb);                     \
+      start = rb->start;                                                \
+      e = rb->buffer[start];                                            \
+      RING_BUFFER_BARRIER();                                            \
+    } while (name ## _lapped(rb));                                      \
+    rb->start = (index_t)(start + 1) & rb->mask;                        \
+    name ## _wake_writers(rb);                                          \
+    return e;                                                           \
+  }                                                                     \
+                                                                        \
+  static inline index_t name ## _write_span(name ## _t *rb,             \
+                                            elem_t **span) {            \
+    index_t end = rb->end;                                              \
+    index_t to_wrap = rb->mask - end;                                   \
+    index_t n = name ## _lapped(rb) ? 0 : name ## _remainder(rb);       \
+    if (n > to_wrap) n = to_wrap + 1;                                   \
+    *span = &rb->buffer[end];                                           \
+    return n;                                                           \
+  }                                                                     \
+                                                                        \
+  static inline void name ## _commit(name ## _t *rb, index_t n) {       \
+    RING_BUFFER_BARRIER();                                              \
+    rb->end = (index_t)(rb->end + n) & rb->mask;                        \
+    name ## _wake_readers(rb);                                          \
+  }                                                                     \
+                                                                        \
+  static inline index_t name ## _read_span(name ## _t *rb,              \
+                                           const elem_t **span) {       \
+    if (name ## _lapped(rb)) name ## _resync(rb);                       \
+    index_t start = rb->start;                                          \
+    index_t to_wrap = rb->mask - start;                                 \
+    index_t n = (index_t)(RING_BUFFER_LOAD(index_t, rb->end) - start)   \
+                & rb->mask;                                             \
+    if (n > to_wrap) n = to_wrap + 1;                                   \
+    *span = &rb->buffer[start];                                         \
+    return n;                                                           \
+  }                                                                     \
+                                                                        \
+  static inline void name ## _release(name ## _t *rb, index_t n) {      \
+    RING_BUFFER_BARRIER();                                              \
+    if (name ## _lapped(rb)) return; /* span was overwritten */         \
+    rb->start = (index_t)(rb->start + n) & rb->mask;                    \
+    name ## _wake_writers(rb);                                          \
+  }                                                                     \
+                                                                        \
+  static inline index_t name ## _write(name ## _t *rb,                  \
+                                       const elem_t *src, index_t n) {  \
+    index_t done = 0;                                                   \
+    uint8_t chunk;                                                      \
+    for (chunk = 0; chunk < 2 && done < n; chunk++) {                   \
+      elem_t *span;                                                     \
+      index_t len = name ## _write_span(rb, &span);                     \
+      if (len == 0) break;                                              \
+      if (len > n - done) len = n - done;                               \
+      memcpy(span, src + done, len * sizeof(elem_t));                   \
+      name ## _commit(rb, len);                                         \
+      done += len;                                                      \
+    }                                                                   \
+    return done;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline index_t name ## _read(name ## _t *rb,                   \
+                                      elem_t *dst, index_t n) {         \
+    index_t done = 0;                                                   \
+    uint8_t chunk;                                                      \
+    for (chunk = 0; chunk < 2 && done < n; chunk++) {                   \
+      const elem_t *span;                                               \
+      index_t len = name ## _read_span(rb, &span);                      \
+      if (len == 0) break;                                              \
+      if (len > n - done) len = n - done;                               \
+      memcpy(dst + done, span, len * sizeof(elem_t));                   \
+      RING_BUFFER_BARRIER();                                            \
+      if (name ## _lapped(rb)) break; /* chunk overwritten mid-copy */  \
+      name ## _release(rb, len);                                        \
+      done += len;                                                      \
+    }                                                                   \
+    return done;                                                        \
+  }                                                                     \
+                                                                        \
+  static inline task_sched_t name ## _wait_space(name ## _t *rb,        \
+                                                 index_t n,             \
+                                                 task_t *task) {        \
+    task_sched_t result = TASK_SCHED_IMMED;                             \
+    if (n > rb->mask) n = rb->mask; /* never more than capacity */      \
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {                                 \
+      if (name ## _remainder(rb) < n) {                                 \
+        if (rb->writers.next == &rb->writers || n < rb->wake_space)     \
+          rb->wake_space = n;                                           \
+        List.addAtRear(&rb->writers, task_list_node(task));             \
+        result = TASK_WAIT;                                             \
+      }                                                                 \
+    }                                                                   \
+    return result;                                                      \
+  }                                                                     \
+                                                                        \
+  static inline task_sched_t name ## _wait_data(name ## _t *rb,         \
+                                                task_t *task) {         \
+    task_sched_t result = TASK_SCHED_IMMED;                             \
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {                                 \
+      if (name ## _empty(rb)) {                                         \
+        List.addAtRear(&rb->readers, task_list_node(task));             \
+        result = TASK_WAIT;                                             \
+      }                                                                 \
+    }                                                                   \
+    return result;                                                      \
+  }
+
+/**
+ * Byte ring buffer used by the Ringbuffer class (up to 256 slots)
+ */
+RING_BUFFER_DECLARE(ring_buffer, uint8_t, uint8_t)
 
 typedef struct {
-  void (* const init)(ring_buffer_t*);
+  void (* const init)(ring_buffer_t*, uint8_t*, uint16_t);
   bool (* const full)(const ring_buffer_t*);
   bool (* const empty)(const ring_buffer_t*);
   bool (* const almost_full)(const ring_buffer_t*);
-  void (* const insert)(ring_buffer_t*, char, bool);
+  void (* const set_policy)(ring_buffer_t*, ring_buffer_policy_t);
+  bool (* const insert)(ring_buffer_t*, char, bool);
   void (* const insert_string)(ring_buffer_t*, const char*);
   char (* const remove)(ring_buffer_t*);
   uint8_t (* const size)(const ring_buffer_t *);
+  uint8_t (* const capacity)(const ring_buffer_t *);
+  uint8_t (* const drops)(const ring_buffer_t *);
+  uint8_t (* const write_span)(ring_buffer_t*, uint8_t**);
+  void (* const commit)(ring_buffer_t*, uint8_t);
+  uint8_t (* const read_span)(ring_buffer_t*, const uint8_t**);
+  void (* const release)(ring_buffer_t*, uint8_t);
+  uint8_t (* const write)(ring_buffer_t*, const uint8_t*, uint8_t);
+  uint8_t (* const read)(ring_buffer_t*, uint8_t*, uint8_t);
+  task_sched_t (* const wait_space)(ring_buffer_t*, uint8_t, task_t*);
+  task_sched_t (* const wait_data)(ring_buffer_t*, task_t*);
+  task_sched_t (* const insert_wait)(ring_buffer_t*, char, task_t*);
+  task_sched_t (* const remove_wait)(ring_buffer_t*, char*, task_t*);
 } ringbuffer_class_t;
 
-extern const ringbuffer_class_t const Ringbuffer;
+extern const ROM ringbuffer_class_t const Ringbuffer;
 
 #endif /* RING_BUFFER_H_ */
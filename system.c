@@ -13,9 +13,15 @@
 #include "vt100.h"
 #include "task.h"
 #include "adc.h"
+#include "telemetry.h"
 
 #define DEFAULT_BAUD 500000
 //#define DEFAULT_BAUD 38400
+// telemetry link, exact at 8 MHz with U2X
+#define TELEMETRY_BAUD 1000000
+
+UART_BAUD_ASSERT(DEFAULT_BAUD);
+UART_BAUD_ASSERT(TELEMETRY_BAUD);
 
 
 /**
@@ -27,6 +33,26 @@ void sys_init(void) {
     scheduler_init();
     ADC_.init();
     uart_init(UART0, DEFAULT_BAUD);
-    term_init(TERM0);
+#if USE_UART1
+    uart_init(UART1, TELEMETRY_BAUD);
+    telemetry_init(UART1);
+#endif
+    term_init(TERM0, UART0);
   }
 }
+
+/**
+ * Bytes of SRAM between the top of the heap (or of .bss when malloc has
+ * not been used) and the stack pointer
+ *
+ * This is what is left at the moment of the call, for watching the
+ * headroom on target. The static .data + .bss use is the "Data" line
+ * avr-size -C prints after every build.
+ *
+ * @return free SRAM in bytes
+ */
+uint16_t sys_free_sram(void) {
+  extern char __heap_start, *__brkval;
+  char top;
+  return &top - (__brkval ? __brkval : &__heap_start);
+}
@@ -16,5 +16,6 @@
 #define MSTICKS (SYSCLOCK/1000L)
 
 void sys_init(void);
+uint16_t sys_free_sram(void);
 
 #endif /* SYSTEM_H_ */
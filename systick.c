@@ -9,6 +9,8 @@
 #include <avr/interrupt.h>
 #include "system.h"
 #include "systick.h"
+#include "uart.h"
+#include "adc.h"
 #include "atmega/systick_atmega.h"
 
 /************************************************************************/
@@ -19,6 +21,8 @@ volatile static tick_t __systick = 0;
 
 ISR(TIMER0_COMPA_vect) {
 	__systick++;
+	uart_rx_tick();
+	adc_tick();
 	TaskQueue.timer_callback();
 }
 
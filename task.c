@@ -14,6 +14,7 @@ static task_t * task_timer_array[MAX_QUEUE];
 static heap_t task_timer_queue;
 
 static list_t task_process_queue;
+static scheduler_idle_fp scheduler_idle = NULL;
 
 static list_t task_dynamic_free;
 static task_t task_dynamic_array[TASK_ALLOC_COUNT];
@@ -47,7 +48,7 @@ static inline heap_key_t task_timer_get_key(const void *v) {
  * @note a pointer to the task object is passed to the callback function
  *       and the task object has a pointer to fdata if any is set
  */
-static void task_init(task_t *task, const task_slice_callback_fp * const callback, void *fdata) {
+static void task_init(task_t *task, const ROM task_slice_callback_fp * const callback, void *fdata) {
   List.init(task_list_node(task));
   task->slices = callback;
   task->fdata = fdata;
@@ -103,7 +104,7 @@ static void task_delete(task_t *task) {
  * @param en Enable
  * @return task object or NULL if no storage is available
  */
-static task_t *task_new(const task_slice_callback_fp * const callback, void *fdata, tick_t start_ticks, bool en) {
+static task_t *task_new(const ROM task_slice_callback_fp * const callback, void *fdata, tick_t start_ticks, bool en) {
   task_t *t = task_allocate();
   if (t) {
     task_init(t, callback, fdata);
@@ -154,7 +155,7 @@ static inline void task_schedule(task_t *task, task_sched_t sched) {
 /**
  * Public Interface for Task Class
  */
-const task_class_t const Task = {
+const ROM task_class_t const Task = {
   .init = task_init,
   .new = task_new,
   .delete = task_delete,
@@ -277,7 +278,7 @@ static void task_queue_process_callback(void) {
 /**
  * Public Interface for the TaskQueue Class
  */
-task_queue_class_t TaskQueue = {
+const ROM task_queue_class_t TaskQueue = {
   .init = task_queue_init,
   .enqueue = task_queue_enqueue,
   .dequeue = task_queue_dequeue,
@@ -300,6 +301,29 @@ void scheduler_init(void) {
   task_queue_init();
 }
 
+/**
+ * Install the scheduler idle hook
+ *
+ * The hook runs with interrupts disabled whenever no task is ready, and
+ * must return with interrupts enabled. Doing sei() immediately followed
+ * by sleep_cpu() lets it sleep without missing the wakeup of a task
+ * scheduled from an ISR.
+ *
+ * There is a single hook. A module installing one keeps the previous
+ * hook and calls it when it has nothing to do itself, so hooks chain.
+ *
+ * @param idle hook, NULL to busy loop
+ * @return the hook that was installed before, NULL if none
+ */
+scheduler_idle_fp scheduler_set_idle(scheduler_idle_fp idle) {
+  scheduler_idle_fp prev;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    prev = scheduler_idle;
+    scheduler_idle = idle;
+  }
+  return prev;
+}
+
 /**
  * Scheduler main event loop
  * @param void
@@ -308,6 +332,12 @@ void scheduler_init(void) {
 void scheduler_run(void) {
   sei();
   while(true) {
+    if (scheduler_idle) {
+      cli();
+      if (List.isEmpty(&task_process_queue))
+        scheduler_idle();
+      sei();
+    }
     task_queue_process_callback();
   }
 }
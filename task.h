@@ -35,19 +35,21 @@ typedef task_slice_result_t (*task_slice_callback_fp)(task_t*);
 
 typedef task_sched_t (*task_callback_fp)(task_t*);
 
+typedef void (*scheduler_idle_fp)(void);
+
 struct task_t{
   list_t lnode;
   bool enabled;
   tick_t start_ticks;
   tick_t ticks;
   uint8_t slice_idx;                     // index of next slice to call
-  const task_slice_callback_fp * slices; // array of slice callback function pointers
+  const ROM task_slice_callback_fp * slices; // array of slice callback function pointers
   void *fdata;
 };
 
 typedef struct {
-  void (* const init)(task_t*, const task_slice_callback_fp * const,void*);
-  task_t *(* const new)(const task_slice_callback_fp * const, void*,tick_t,bool);
+  void (* const init)(task_t*, const ROM task_slice_callback_fp * const,void*);
+  task_t *(* const new)(const ROM task_slice_callback_fp * const, void*,tick_t,bool);
   void (*delete)(task_t*);
   void (* const set_ticks)(task_t*, tick_t);
   void (* const enable)(task_t*);
@@ -66,9 +68,10 @@ typedef struct {
 
 void scheduler_init(void);
 void scheduler_run(void);
+scheduler_idle_fp scheduler_set_idle(scheduler_idle_fp);
 
-extern const task_class_t const Task;
-extern task_queue_class_t TaskQueue;
+extern const ROM task_class_t const Task;
+extern const ROM task_queue_class_t TaskQueue;
 
 static inline task_t *task_list_entry(const list_t *lnode) {
   return LIST_ENTRY(lnode, task_t, lnode);
@@ -141,7 +141,7 @@ static inline bool mutex_have_lock(const task_mutex_t *mutex, const task_t *task
 /**
  * Public interface to Mutex class
  */
-const task_mutex_class_t const Mutex = {
+const ROM task_mutex_class_t const Mutex = {
   .init = mutex_init,
   .try_lock = mutex_try_lock,
   .lock = mutex_lock,
@@ -27,6 +27,6 @@ typedef struct {
 
 task_slice_result_t mutex_task_wait(task_t*, uint8_t);
 
-extern const task_mutex_class_t const Mutex;
+extern const ROM task_mutex_class_t const Mutex;
 
 #endif /* TASK_MUTEX_H_ */
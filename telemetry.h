@@ -0,0 +1,32 @@
+/*
+ * telemetry.h
+ *
+ * Binary telemetry records over a UART
+ *
+ * Each record is
+ *   channel (1) | timestamp in systicks (4, LE) | payload (0..TELEMETRY_PAYLOAD_MAX)
+ *   | CRC-16/CCITT-FALSE of everything before it (2, LE)
+ * COBS encoded and terminated by a 0x00 byte, so a receiver can always
+ * resynchronise on the next zero. tools/telemetry_decode.py decodes a
+ * capture on the host.
+ *
+ * sys_init attaches telemetry to UART1 on boards built with USE_UART1,
+ * otherwise telemetry_send drops every record.
+ */ 
+
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "uart.h"
+
+#define TELEMETRY_PAYLOAD_MAX 32
+
+void telemetry_init(uart_t *uart);
+bool telemetry_send(uint8_t channel, const void *payload, uint8_t len);
+uint16_t telemetry_drops(void);
+uint16_t telemetry_crc16(uint16_t crc, const uint8_t *buf, uint8_t len);
+
+#endif /* TELEMETRY_H_ */
@@ -0,0 +1,13 @@
+/*
+ * Host stand-in for <avr/interrupt.h>
+ */
+#ifndef HOST_AVR_INTERRUPT_H_
+#define HOST_AVR_INTERRUPT_H_
+
+#include "io.h"
+
+#define ISR(v, ...) void v(void); void v(void)
+#define sei()
+#define cli()
+
+#endif
@@ -0,0 +1,11 @@
+/*
+ * Host stand-in for <avr/io.h>, just enough for the tools/ tests to
+ * compile firmware sources with the host compiler
+ */
+#ifndef HOST_AVR_IO_H_
+#define HOST_AVR_IO_H_
+
+#include <stdint.h>
+#include "sfr_defs.h"
+
+#endif
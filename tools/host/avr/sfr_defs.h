@@ -0,0 +1,9 @@
+/*
+ * Host stand-in for <avr/sfr_defs.h>
+ */
+#ifndef HOST_AVR_SFR_DEFS_H_
+#define HOST_AVR_SFR_DEFS_H_
+
+#define _BV(b) (1 << (b))
+
+#endif
@@ -0,0 +1,13 @@
+/*
+ * Host <stdio.h> plus the avr-libc stream extensions
+ */
+#ifndef HOST_STDIO_H_
+#define HOST_STDIO_H_
+
+#include_next <stdio.h>
+
+#define _FDEV_EOF (-2)
+#define _FDEV_ERR (-1)
+FILE *fdevopen(int (*)(char, FILE *), int (*)(FILE *));
+
+#endif
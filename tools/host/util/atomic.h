@@ -0,0 +1,13 @@
+/*
+ * Host stand-in for <util/atomic.h>, the tests are single threaded
+ */
+#ifndef HOST_UTIL_ATOMIC_H_
+#define HOST_UTIL_ATOMIC_H_
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+#define NONATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(t) for (int __done = 0; !__done; __done = 1)
+#define NONATOMIC_BLOCK(t) for (int __done = 0; !__done; __done = 1)
+
+#endif
@@ -0,0 +1,81 @@
+/*
+ * telemetry_capture.c
+ *
+ * Host harness around the firmware encoder in telemetry.c, writes the
+ * frames checked by test_telemetry_decode.py to stdout. The UART and the
+ * systick are stubbed: every byte queued for the UART is captured, and
+ * the systick counts up one tick per call from 0x12345678, which the
+ * rejected record before telemetry_init takes.
+ *
+ * Rebuild tools/telemetry_capture.bin after changing the encoder with
+ *   cc -std=gnu99 -funsigned-char -fshort-enums -isystem tools/host -I. \
+ *      tools/telemetry_capture.c telemetry.c -o telemetry_capture
+ *   ./telemetry_capture > tools/telemetry_capture.bin
+ */
+
+#include <stdio.h>
+#include "telemetry.h"
+#include "systick.h"
+
+static tick_t now = 0x12345678;
+static uint8_t captured[1024];
+static uint16_t captured_len;
+
+tick_t systick_get(void) {
+  return now++;
+}
+
+uint16_t uart_write_async(uart_t *uart, const uint8_t *buf, uint16_t len,
+                          task_t *task, task_sched_t *sched) {
+  (void)uart;
+  (void)task;
+  if (sched) *sched = TASK_SCHED_IMMED;
+  memcpy(captured + captured_len, buf, len);
+  captured_len += len;
+  return len;
+}
+
+// the TX ring always has room
+static uint8_t capture_capacity(const ring_buffer_t *rb) {
+  (void)rb;
+  return 127;
+}
+
+static uint8_t capture_size(const ring_buffer_t *rb) {
+  (void)rb;
+  return 0;
+}
+
+const ringbuffer_class_t Ringbuffer = {
+  .capacity = capture_capacity,
+  .size = capture_size
+};
+
+int main(void) {
+  static uart_t uart;
+  uint8_t payload[32] = { 0 };
+  const uint8_t marker[3] = { 0xAA, 0xBB, 0xCC };
+  uint16_t value = 1023;
+  uint16_t start;
+
+  // nothing goes out before telemetry_init
+  if (telemetry_send(9, payload, 1))
+    return 1;
+  telemetry_init(&uart);
+
+  for (uint8_t i = 0; i < sizeof(payload); ++i)
+    payload[i] = i % 3 ? i : 0;
+  telemetry_send(1, payload, 4);
+  telemetry_send(2, payload, 32);
+  telemetry_send(0, payload, 0);
+  telemetry_send(3, &value, sizeof(value));
+  start = captured_len;
+  telemetry_send(4, marker, sizeof(marker));
+  fwrite(captured, 1, captured_len, stdout);
+
+  // the last record again with one payload byte flipped on the wire
+  for (uint16_t i = start; i < captured_len; ++i)
+    if (captured[i] == 0xBB) captured[i] = 0xBD;
+  fwrite(captured + start, 1, captured_len - start, stdout);
+  return 0;
+}
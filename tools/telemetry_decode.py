@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""Decode binary telemetry captured from the board's telemetry UART.
+
+Frames are COBS encoded and terminated by 0x00 (see telemetry.h). Each
+decoded record is
+    channel (u8) | timestamp in systicks (u32 LE) | payload | CRC-16 (LE)
+where the CRC is CRC-16/CCITT-FALSE over everything before it.
+
+Usage:
+    telemetry_decode.py [capture.bin]    # reads stdin when no file given
+    telemetry_decode.py --u16 capture.bin  # show payloads as LE uint16s
+
+Exits non-zero if any frame fails to decode or fails its CRC.
+"""
+
+import argparse
+import struct
+import sys
+
+
+def crc16_ccitt(data, crc=0xFFFF):
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+def cobs_decode(frame):
+    out = bytearray()
+    i = 0
+    while i < len(frame):
+        code = frame[i]
+        if code == 0 or i + code > len(frame) + 1:
+            raise ValueError("bad COBS code at offset %d" % i)
+        out += frame[i + 1:i + code]
+        i += code
+        if code != 0xFF and i < len(frame):
+            out.append(0)
+    return bytes(out)
+
+
+def decode_record(frame):
+    raw = cobs_decode(frame)
+    if len(raw) < 7:
+        raise ValueError("short record (%d bytes)" % len(raw))
+    body, (crc,) = raw[:-2], struct.unpack("<H", raw[-2:])
+    if crc16_ccitt(body) != crc:
+        raise ValueError("CRC mismatch")
+    channel, stamp = struct.unpack("<BI", body[:5])
+    return channel, stamp, body[5:]
+
+
+def frames(data):
+    # the first chunk may start mid-frame if the capture began late
+    chunks = data.split(b"\x00")
+    return chunks[:-1]
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("capture", nargs="?", help="raw capture file")
+    ap.add_argument("--u16", action="store_true",
+                    help="print payloads as little-endian uint16 values")
+    args = ap.parse_args()
+
+    if args.capture:
+        with open(args.capture, "rb") as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+
+    bad = 0
+    for n, frame in enumerate(frames(data)):
+        if not frame:
+            continue
+        try:
+            channel, stamp, payload = decode_record(frame)
+        except ValueError as e:
+            bad += 1
+            print("frame %d: %s" % (n, e), file=sys.stderr)
+            continue
+        if args.u16 and len(payload) % 2 == 0:
+            shown = " ".join(str(v) for v in
+                             struct.unpack("<%dH" % (len(payload) // 2), payload))
+        else:
+            shown = payload.hex()
+        print("%10d ch%-3d %s" % (stamp, channel, shown))
+    return 1 if bad else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
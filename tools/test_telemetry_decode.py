@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+"""Check telemetry_decode.py against a capture of the firmware encoder.
+
+telemetry_capture.bin holds the frames telemetry.c produced for:
+    ch1  00 01 02 00              (payload with 0x00 bytes)
+    ch2  32 bytes, every third one 00
+    ch0  empty payload
+    ch3  uint16 1023
+    ch4  aa bb cc
+    ch4  aa bb cc with one byte flipped on the wire (fails the CRC)
+with the systick counting up from 0x12345679, one tick per record.
+telemetry_capture.c regenerates it. EncoderTest builds that harness and
+telemetry.c with the host C compiler and checks the output still matches,
+it is skipped when there is no compiler.
+
+Run from anywhere:
+    python3 tools/test_telemetry_decode.py
+"""
+
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import unittest
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, HERE)
+
+import telemetry_decode as td  # noqa: E402
+
+ROOT = os.path.join(HERE, "..")
+CAPTURE = os.path.join(HERE, "telemetry_capture.bin")
+TELEMETRY_C = os.path.join(ROOT, "telemetry.c")
+HARNESS_C = os.path.join(HERE, "telemetry_capture.c")
+CC = os.environ.get("CC") or shutil.which("cc") or shutil.which("gcc")
+STAMP = 0x12345679
+
+
+def load_frames():
+    with open(CAPTURE, "rb") as f:
+        return td.frames(f.read())
+
+
+class Crc16Test(unittest.TestCase):
+    def test_check_value(self):
+        # CRC-16/CCITT-FALSE catalogue check value
+        self.assertEqual(td.crc16_ccitt(b"123456789"), 0x29B1)
+
+    def test_firmware_table(self):
+        with open(TELEMETRY_C) as f:
+            src = f.read()
+        body = src[src.index("crc16_table[256]"):]
+        body = body[:body.index("};")]
+        table = [int(v, 16) for v in re.findall(r"0x([0-9A-Fa-f]{4})", body)]
+        self.assertEqual(len(table), 256)
+        for i, entry in enumerate(table):
+            self.assertEqual(entry, td.crc16_ccitt(bytes([i]), crc=0),
+                             "crc16_table[%d]" % i)
+
+
+class CaptureTest(unittest.TestCase):
+    def setUp(self):
+        self.frames = load_frames()
+
+    def test_frame_count(self):
+        self.assertEqual(len(self.frames), 6)
+
+    def test_records(self):
+        p = bytes(i if i % 3 else 0 for i in range(32))
+        expected = [
+            (1, STAMP + 0, p[:4]),
+            (2, STAMP + 1, p),
+            (0, STAMP + 2, b""),
+            (3, STAMP + 3, (1023).to_bytes(2, "little")),
+            (4, STAMP + 4, b"\xaa\xbb\xcc"),
+        ]
+        for frame, want in zip(self.frames, expected):
+            self.assertEqual(td.decode_record(frame), want)
+
+    def test_zero_bytes_never_on_the_wire(self):
+        for frame in self.frames:
+            self.assertNotIn(0, frame)
+
+    def test_crc_failure(self):
+        with self.assertRaisesRegex(ValueError, "CRC"):
+            td.decode_record(self.frames[5])
+
+    def test_cli_reports_bad_frame(self):
+        argv, stdout, stderr = sys.argv, sys.stdout, sys.stderr
+        try:
+            sys.argv = ["telemetry_decode.py", CAPTURE]
+            sys.stdout = sys.stderr = open(os.devnull, "w")
+            rc = td.main()
+        finally:
+            sys.stdout.close()
+            sys.argv, sys.stdout, sys.stderr = argv, stdout, stderr
+        self.assertEqual(rc, 1)
+
+
+@unittest.skipUnless(CC, "no host C compiler")
+class EncoderTest(unittest.TestCase):
+    def test_firmware_encoder_matches_capture(self):
+        with tempfile.TemporaryDirectory() as tmp:
+            exe = os.path.join(tmp, "telemetry_capture")
+            subprocess.run([CC, "-std=gnu99", "-funsigned-char", "-fshort-enums",
+                            "-isystem", os.path.join(HERE, "host"), "-I", ROOT,
+                            HARNESS_C, TELEMETRY_C, "-o", exe],
+                           check=True, stderr=subprocess.DEVNULL)
+            out = subprocess.run([exe], check=True, stdout=subprocess.PIPE).stdout
+        with open(CAPTURE, "rb") as f:
+            self.assertEqual(out, f.read())
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -14,6 +14,18 @@
 
 #define TICK_MAX UINT32_MAX
 
+/**
+ * Qualifier for constant tables that only need to live in flash. With
+ * avr-gcc's __flash address space reads go through LPM transparently, so
+ * Table.member(...) call sites stay as they are and the table is not
+ * copied into SRAM at startup.
+ */
+#ifdef __FLASH
+#define ROM __flash
+#else
+#define ROM
+#endif
+
 typedef uint32_t tick_t;
 
 typedef struct {
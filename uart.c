@@ -12,6 +12,7 @@
 #include "uart.h"
 #include "atmega/bits_atmega.h"
 #include <util/atomic.h>
+#include <avr/pgmspace.h>
 
 /**
    This website explains serial HW flow control properly
@@ -19,64 +20,70 @@
    Surprisingly, it is somewhat difficult to find usable documentation
    on the subject.
 */
-static ring_buffer_t TX_buffer0;
-static ring_buffer_t RX_buffer0;
-
-static int serial0_putc(char c, FILE*);
-static int serial0_getc(FILE*);
-
-// Set serial0 and serial1 to the beginning
-// of USART0 and USART1 devices in memory
-static uart_t __serial0 = {
-  .regs = (usart_atmega_regs_t *)(0xC0),
-  .tx_buffer = &TX_buffer0,
-  .rx_buffer = &RX_buffer0,
-  .rts = GPIO_PIN(B,7),
-  .cts = GPIO_PIN(B,6),
-  .putc = serial0_putc,
-  .getc = serial0_getc
-};
-
-uart_t * const UART0 = &__serial0;
+#define UART0_TX_BUFFER_SIZE 128
+#define UART0_TX_QUEUE_SIZE 8
+#define UART0_RX_BUFFER_SIZE 128
+#define UART0_RX_FRAMES_SIZE 8
 
 #if USE_UART1
-static uart_t __serial1 = {
-  .regs = (usart_atmega_regs_t *)(0xC8)
-};
-
-uart_t * const UART1 = &__serial1;
+// boards enabling UART1 may size its buffers to what they send
+#ifndef UART1_TX_BUFFER_SIZE
+#define UART1_TX_BUFFER_SIZE 128
+#endif
+#ifndef UART1_TX_QUEUE_SIZE
+#define UART1_TX_QUEUE_SIZE 8
+#endif
+#ifndef UART1_RX_BUFFER_SIZE
+#define UART1_RX_BUFFER_SIZE 64
+#endif
+#ifndef UART1_RX_FRAMES_SIZE
+#define UART1_RX_FRAMES_SIZE 8
+#endif
 #endif
-
-/**
- * Calculate baud register values based on desired baud rate
- * @param baud Baud rate to set
- * @return 16-bit register value for ubbrX register
- * @note Normal caveats apply when using 16-bit reg values
- */
-static inline uint16_t calc_baud_ubbrx(uint32_t baud) {
-  return ((SYSCLOCK / ((uint32_t)16*(uint32_t)baud)) -1);
-}
 
 /**
  * Initialize UART device
+ *
+ * The solved rate and its error are left in uart->baud.
+ *
  * @param uart UART device
  * @param baud Baud rate to set
- * @return void
+ * @return false, leaving the UART off, if baud is not within
+ *         UART_BAUD_TOLERANCE of any reachable rate
  */
-void uart_init(uart_t *uart, uint32_t baud) {
-  uint16_t ubrrx = calc_baud_ubbrx(baud);
-  usart_atmega_init(uart->regs, ubrrx);
-  Ringbuffer.init(uart->tx_buffer);
-  Ringbuffer.init(uart->rx_buffer);
+bool uart_init(uart_t *uart, uint32_t baud) {
+  if (!uart_baud_solve(baud, &uart->baud))
+    return false;
+
+  usart_atmega_init(uart->regs, uart->baud.ubrr, uart->baud.u2x);
+  Ringbuffer.init(uart->tx_buffer, uart->tx_storage, uart->tx_size);
+  uart_tx_queue_init(uart->tx_queue, uart->tx_queue_storage, uart->tx_queue_size);
+  uart->tx_pos = 0;
+  uart->tx_ring_out = 0;
+  uart->tx_ring_in = 0;
+  uart->tx_ring_mark = 0;
+  Ringbuffer.init(uart->rx_buffer, uart->rx_storage, uart->rx_size);
+  uart_rx_frames_init(uart->rx_frames, uart->rx_frames_storage, uart->rx_frames_size);
+  uart_rx_framing(uart, UART_RX_RAW, 0);
+  uart->rx_overruns = 0;
+  uart->rx_throttled = false;
+  // stop the sender with RING_BUFFER_TOO_CLOSE bytes of slack left, let
+  // it go again at half full; a ring too small for that slack stops at full
+  if (!uart_rx_watermarks(uart, Ringbuffer.capacity(uart->rx_buffer) - RING_BUFFER_TOO_CLOSE,
+                          Ringbuffer.capacity(uart->rx_buffer) / 2))
+    uart_rx_watermarks(uart, Ringbuffer.capacity(uart->rx_buffer),
+                       Ringbuffer.capacity(uart->rx_buffer) / 2);
 
 #if UART_HW_FLOW_CTL
   gpio_pin_set_direction(uart->cts, in);
   gpio_pin_set_direction(uart->rts, out);
   gpio_pin_set_value(uart->rts, unset);	
+  REG_SETBIT(PCICR, uart->cts_pcie);
 #endif
 
   // initialize put char function if one is configured
   if (uart->putc) { fdevopen(uart->putc, uart->getc); }
+  return true;
 }
 
 /**
@@ -107,69 +114,613 @@ static inline void uart_deassert_ready_to_receive(const uart_t *uart) {
 }
 
 /**
- * putc function for UART0
+ * Start the transmitter draining the TX ring
+ *
+ * The UDRE ISR may clear UDRIE between our read and write of UCSRxB;
+ * setting it again only costs one spurious (empty) UDRE interrupt.
+ *
+ * @param uart UART device
+ * @return void
+ */
+static inline void uart_tx_kick(uart_t *uart) {
+  REG_SETBIT(uart->regs->UCSRxB, UDRE0);
+}
+
+/**
+ * Stop the transmitter until the other side asserts CTS again
+ * @param uart UART device
+ * @return void
+ */
+static inline void uart_tx_hold(uart_t *uart) {
+  REG_CLRBIT(uart->regs->UCSRxB, UDRE0);
+  REG_SETBIT(*uart->cts_pcmsk, uart->cts_pcint);
+
+  // CTS may have come back before the pin change irq was unmasked
+  if (uart_read_ready_to_receive(uart)) {
+    REG_CLRBIT(*uart->cts_pcmsk, uart->cts_pcint);
+    uart_tx_kick(uart);
+  }
+}
+
+/**
+ * Put one character into the TX ring, shared by every instance's putc
+ *
+ * CTS is handled by the UDRE ISR, so this only waits when the TX ring is
+ * full. Tasks that must not wait at all should use uart_write_async.
+ *
+ * @param uart UART device
  * @param c Char to put onto device
- * @param f FILE pointer for device
  * @return 0 if okay, error of some sort if not
  */
-static int serial0_putc(char c, FILE *f) {
-  (void)f;
+int uart_putc(uart_t *uart, char c) {
+  // the TX ring is SPSC: this task is the only producer and the UDRE ISR
+  // is the only consumer, so no critical section is needed here
+  Ringbuffer.insert(uart->tx_buffer, c, true);
+  uart->tx_ring_in++;
+  uart_tx_kick(uart);
+  return 0;
+}
+
+/**
+ * Queue data for transmission without blocking
+ *
+ * Copies as much of buf as fits into the TX ring and returns. If some of
+ * buf did not fit and task is not NULL, task is parked until the rest can
+ * be accepted. The slice returns *sched and calls again with the
+ * remainder, as with uart_flush_async.
+ *
+ * @param uart UART device
+ * @param buf Data to send
+ * @param len Number of bytes in buf
+ * @param task Task to wake when there is room for the remainder, or NULL
+ * @param sched Set to TASK_WAIT if task was parked, else TASK_SCHED_IMMED;
+ *        may be NULL when task is NULL
+ * @return number of bytes queued
+ */
+uint16_t uart_write_async(uart_t *uart, const uint8_t *buf, uint16_t len,
+                          task_t *task, task_sched_t *sched) {
+  task_sched_t result = TASK_SCHED_IMMED;
+  uint16_t done = 0;
+  while (done < len) {
+    uint16_t chunk = len - done;
+    uint8_t n = Ringbuffer.write(uart->tx_buffer, buf + done,
+                                 chunk > UINT8_MAX ? UINT8_MAX : chunk);
+    if (n == 0) break;
+    done += n;
+  }
+  uart->tx_ring_in += done;
+  if (done) uart_tx_kick(uart);
+
+  if (done < len && task) {
+    uint16_t want = len - done;
+    uint8_t capacity = Ringbuffer.capacity(uart->tx_buffer);
+    if (want > capacity) want = capacity;
+    // TASK_SCHED_IMMED if the ISR has made room already
+    result = Ringbuffer.wait_space(uart->tx_buffer, want, task);
+  }
+  if (sched) *sched = result;
+  return done;
+}
+
+/**
+ * Wait for everything queued on the UART to be handed to the hardware
+ *
+ * Call again when woken, until it returns TASK_SCHED_IMMED.
+ *
+ * @param uart UART device
+ * @param task Task to wake when the TX ring or descriptor queue drains
+ * @return TASK_WAIT if task was parked, TASK_SCHED_IMMED if already empty
+ */
+task_sched_t uart_flush_async(uart_t *uart, task_t *task) {
+  if (!uart_tx_queue_empty(uart->tx_queue))
+    return uart_tx_queue_wait_space(uart->tx_queue, uart_tx_queue_capacity(uart->tx_queue), task);
+  return Ringbuffer.wait_space(uart->tx_buffer, Ringbuffer.capacity(uart->tx_buffer), task);
+}
+
+/**
+ * Queue a scatter-gather descriptor for transmission, no copy is made
+ *
+ * Bytes already put into the TX ring (putc, uart_write_async) are sent
+ * before buf. buf must stay valid until it is sent.
+ *
+ * @param uart UART device
+ * @param buf Data to send, in SRAM or flash
+ * @param len Number of bytes in buf
+ * @param src UART_TX_RAM or UART_TX_PGM
+ * @param task If queued, scheduled once buf has been sent. If the queue
+ *        was full, parked until there is room to try again. May be NULL.
+ * @param sched Set to what the slice returns: TASK_WAIT if task will be
+ *        woken, else TASK_SCHED_IMMED; may be NULL when task is NULL
+ * @return true if queued
+ */
+bool uart_send(uart_t *uart, const void *buf, uint16_t len, uart_tx_src_t src,
+               task_t *task, task_sched_t *sched) {
+  // ring bytes that are not covered by a descriptor yet need a mark first
+  uint8_t need = (uart->tx_ring_in != uart->tx_ring_mark) ? 2 : 1;
+
+  if (uart_tx_queue_remainder(uart->tx_queue) < need) {
+    // TASK_SCHED_IMMED if the ISR has freed a descriptor already
+    if (sched)
+      *sched = task ? uart_tx_queue_wait_space(uart->tx_queue, need, task)
+                    : TASK_SCHED_IMMED;
+    return false;
+  }
+
+  if (need == 2) {
+    uart->tx_ring_mark = uart->tx_ring_in;
+    uart_tx_queue_put(uart->tx_queue, (uart_tx_desc_t){ NULL, uart->tx_ring_mark, UART_TX_RING, NULL });
+  }
+  uart_tx_queue_put(uart->tx_queue, (uart_tx_desc_t){ buf, len, src, task });
+  uart_tx_kick(uart);
+  if (sched) *sched = task ? TASK_WAIT : TASK_SCHED_IMMED;
+  return true;
+}
+
+/**
+ * Queue a flash resident string without blocking
+ *
+ * Like uart_send: when the descriptor queue is full nothing is queued,
+ * task is parked until a descriptor frees up and the slice returns *sched
+ * and calls again.
+ *
+ * @param uart UART device
+ * @param s String in PROGMEM
+ * @param task Task to wake once s is sent or a descriptor is free, or NULL
+ * @param sched Set to what the slice returns, may be NULL when task is NULL
+ * @return true if queued
+ */
+bool uart_puts_P(uart_t *uart, const char *s, task_t *task, task_sched_t *sched) {
+  return uart_send(uart, s, strlen_P(s), UART_TX_PGM, task, sched);
+}
+
+/**
+ * Get the next byte to transmit, walking the descriptor queue (ISR only)
+ *
+ * UART_TX_RING descriptors hand over to the TX ring until tx_ring_out
+ * reaches their mark. With no descriptors left the TX ring is drained
+ * directly.
+ *
+ * @param uart UART device
+ * @return next byte, or -1 if there is nothing to send
+ */
+static inline int16_t uart_tx_next(uart_t *uart) {
+  uart_tx_queue_t *q = uart->tx_queue;
+
+  while (!uart_tx_queue_empty(q)) {
+    uart_tx_desc_t *d = &q->buffer[q->start];
+    int16_t c = -1;
+
+    if (d->src == UART_TX_RING) {
+      if ((int8_t)((uint8_t)d->len - uart->tx_ring_out) > 0) {
+        uart->tx_ring_out++;
+        return Ringbuffer.remove(uart->tx_buffer);
+      }
+    }
+    else if (uart->tx_pos < d->len) {
+      const uint8_t *p = (const uint8_t *)d->ptr + uart->tx_pos++;
+      c = (d->src == UART_TX_PGM) ? pgm_read_byte(p) : *p;
+      if (uart->tx_pos < d->len) return c;
+    }
+
+    // descriptor done, free it before the last byte goes out
+    task_t *task = d->task;
+    uart->tx_pos = 0;
+    uart_tx_queue_get(q);
+    if (task) Task.schedule(task, TASK_SCHED_IMMED);
+    if (c >= 0) return c;
+  }
+
+  if (!Ringbuffer.empty(uart->tx_buffer)) {
+    uart->tx_ring_out++;
+    return Ringbuffer.remove(uart->tx_buffer);
+  }
+  return -1;
+}
+
+/**
+ * True if the ISR has anything left to send
+ * @param uart UART device
+ * @return true if descriptors or TX ring bytes are pending
+ */
+static inline bool uart_tx_pending(const uart_t *uart) {
+  return !uart_tx_queue_empty(uart->tx_queue) || !Ringbuffer.empty(uart->tx_buffer);
+}
+
+/**
+ * Deassert RTS once the RX ring reaches the high watermark (ISR only)
+ *
+ * Only the RX ISR turns RTS off and only a reader turns it back on, each
+ * guarded by rx_throttled, so RTS changes just on threshold crossings.
+ *
+ * A reader frees space a whole frame at a time. Once the frame still
+ * being received holds more than rx_low bytes, reading every complete
+ * frame cannot bring the ring down to rx_low, and with RTS off the rest
+ * of that frame never arrives. Such a frame is cut: what has arrived is
+ * delivered as a frame, the rest is discarded and the frame is counted
+ * in rx_frame_drops.
+ *
+ * @param uart UART device
+ * @return void
+ */
+static inline void uart_rx_throttle(uart_t *uart) {
+  if (!uart->rx_throttled && Ringbuffer.size(uart->rx_buffer) >= uart->rx_high) {
+    uart->rx_throttled = true;
+    uart_deassert_ready_to_receive(uart);
+  }
+  if (uart->rx_throttled && uart->rx_in_frame && !uart->rx_discard &&
+      uart->rx_count > uart->rx_low) {
+    // the frame got its slot in rx_frames when it started
+    uart_rx_frames_put(uart->rx_frames, uart->rx_count);
+    uart->rx_count = 0;
+    uart->rx_discard = true;
+  }
+}
 
-  // block until other side asserts RTS
-  NONATOMIC_BLOCK(NONATOMIC_RESTORESTATE) {
-    while(!uart_read_ready_to_receive(UART0)) ;
+/**
+ * Reassert RTS once a reader has drained the RX ring to the low watermark
+ * @param uart UART device
+ * @return void
+ */
+static inline void uart_rx_unthrottle(uart_t *uart) {
+  if (uart->rx_throttled && Ringbuffer.size(uart->rx_buffer) <= uart->rx_low) {
+    uart->rx_throttled = false;
+    uart_assert_ready_to_receive(uart);
   }
-	
+}
+
+/**
+ * Set the RTS hysteresis thresholds
+ *
+ * The space above high must cover what the sender still pushes after RTS
+ * drops (its shift register and FIFO, plus any latency in noticing).
+ *
+ * @param uart UART device
+ * @param high RX ring fill level that deasserts RTS, 1 to the capacity
+ * @param low RX ring fill level that reasserts RTS, below high
+ * @return false, leaving the thresholds unchanged, if they are out of range
+ */
+bool uart_rx_watermarks(uart_t *uart, uint8_t high, uint8_t low) {
+  if (high == 0 || high > Ringbuffer.capacity(uart->rx_buffer) || low >= high)
+    return false;
   ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-    Ringbuffer.insert(UART0->tx_buffer, c, true);
+    uart->rx_high = high;
+    uart->rx_low = low;
+  }
+  return true;
+}
 
-    // enable data register empty irq
-    REG_SETBIT(UART0->regs->UCSRxB, UDRE0); 
+/**
+ * Number of received bytes the USART overwrote before the ISR read them
+ * @param uart UART device
+ * @return overrun count
+ */
+uint16_t uart_rx_overruns(const uart_t *uart) {
+  uint16_t n;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    n = uart->rx_overruns;
   }
-  return 0;
+  return n;
+}
+
+/**
+ * Number of received bytes dropped because the RX ring was full
+ * @param uart UART device
+ * @return drop count, wraps at 256
+ */
+uint8_t uart_rx_drops(const uart_t *uart) {
+  return Ringbuffer.drops(uart->rx_buffer);
+}
+
+/**
+ * Number of frames lost to a full rx_frames queue or cut short because
+ * they did not fit below the RTS watermarks
+ * @param uart UART device
+ * @return drop count, wraps at 256
+ */
+uint8_t uart_rx_frame_drops(const uart_t *uart) {
+  return uart->rx_frame_drops;
+}
+
+/**
+ * Select how the RX ISR delimits frames
+ *
+ * Anything already received is discarded, bytes that arrived under the
+ * old mode would otherwise sit outside any frame.
+ *
+ * @param uart UART device
+ * @param mode Framing mode
+ * @param arg Delimiter for UART_RX_LINE, gap in systicks for UART_RX_IDLE,
+ *        ignored otherwise
+ * @return void
+ */
+void uart_rx_framing(uart_t *uart, uart_rx_framing_t mode, uint8_t arg) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    uart->rx_mode = mode;
+    uart->rx_delim = arg;
+    uart->rx_idle_ticks = arg;
+    uart->rx_idle_left = 0;
+    uart->rx_count = 0;
+    uart->rx_in_frame = false;
+    Ringbuffer.release(uart->rx_buffer, Ringbuffer.size(uart->rx_buffer));
+    uart_rx_frames_release(uart->rx_frames, uart_rx_frames_size(uart->rx_frames));
+    uart_rx_unthrottle(uart);
+  }
+}
+
+/**
+ * Wait for a complete frame (or any byte in UART_RX_RAW mode)
+ * @param uart UART device
+ * @param task Task to wake when a frame arrives
+ * @return TASK_WAIT if task was parked, TASK_SCHED_IMMED if one is ready
+ */
+task_sched_t uart_rx_wait_frame(uart_t *uart, task_t *task) {
+  if (uart->rx_mode == UART_RX_RAW)
+    return Ringbuffer.wait_data(uart->rx_buffer, task);
+  return uart_rx_frames_wait_data(uart->rx_frames, task);
+}
+
+/**
+ * Read the next complete frame
+ *
+ * Bytes past max are discarded with the rest of the frame. In
+ * UART_RX_RAW mode whatever has arrived, up to max, is read.
+ *
+ * @param uart UART device
+ * @param dst Destination buffer
+ * @param max Size of dst
+ * @return bytes copied to dst, -1 if no frame is ready
+ */
+int16_t uart_rx_read_frame(uart_t *uart, uint8_t *dst, uint8_t max) {
+  uint8_t len, n;
+
+  if (uart->rx_mode == UART_RX_RAW) {
+    if (Ringbuffer.empty(uart->rx_buffer)) return -1;
+    n = Ringbuffer.read(uart->rx_buffer, dst, max);
+  }
+  else {
+    if (uart_rx_frames_empty(uart->rx_frames)) return -1;
+    len = uart_rx_frames_peek(uart->rx_frames);
+    n = Ringbuffer.read(uart->rx_buffer, dst, len < max ? len : max);
+    for (uint8_t i = n; i < len; ++i)
+      Ringbuffer.remove(uart->rx_buffer);
+    uart_rx_frames_get(uart->rx_frames);
+  }
+
+  uart_rx_unthrottle(uart);
+  return n;
 }
 
 /**
- * Decides when it is time to set and unset Ready-to-Receive for UART0
- * @param void
+ * Close the frame being received (ISR only)
+ * @param uart UART device
  * @return void
  */
-static void uart_handle_rx_full(void) {
-  if (Ringbuffer.almost_full(UART0->rx_buffer))
-    uart_deassert_ready_to_receive(UART0);
+static inline void uart_rx_end_frame(uart_t *uart) {
+  if (uart->rx_discard)
+    uart->rx_frame_drops++;
   else
-    uart_assert_ready_to_receive(UART0);
+    uart_rx_frames_put(uart->rx_frames, uart->rx_count);
+  uart->rx_count = 0;
+  uart->rx_in_frame = false;
 }
 
 /**
- * getc function for UART0
- * @param f FILE pointer for UART0
+ * Run a received byte through the framer (ISR only)
+ *
+ * A frame is only started when its length has a slot in rx_frames, so
+ * the byte ring and the length queue never disagree. Bytes the ring
+ * has no room for are dropped from the frame and counted by
+ * Ringbuffer.drops().
+ *
+ * @param uart UART device
+ * @param c Received byte
+ * @return void
+ */
+static inline void uart_rx_byte(uart_t *uart, uint8_t c) {
+  if (uart->rx_mode == UART_RX_RAW) {
+    Ringbuffer.insert(uart->rx_buffer, c, false);
+    return;
+  }
+
+  if (!uart->rx_in_frame) {
+    uart->rx_in_frame = true;
+    uart->rx_discard = uart_rx_frames_full(uart->rx_frames);
+    if (uart->rx_mode == UART_RX_LENGTH) {
+      uart->rx_expect = c;
+      if (c == 0) uart_rx_end_frame(uart);
+      return;
+    }
+  }
+
+  if (uart->rx_mode == UART_RX_LINE && c == uart->rx_delim) {
+    uart_rx_end_frame(uart);
+    return;
+  }
+
+  if (!uart->rx_discard && Ringbuffer.insert(uart->rx_buffer, c, false))
+    uart->rx_count++;
+
+  if (uart->rx_mode == UART_RX_LENGTH && --uart->rx_expect == 0)
+    uart_rx_end_frame(uart);
+  else if (uart->rx_mode == UART_RX_IDLE)
+    uart->rx_idle_left = uart->rx_idle_ticks;
+}
+
+/**
+ * getc body shared by every instance
+ * @note Only meaningful in UART_RX_RAW mode, use uart_rx_read_frame
+ *       when framing is enabled
+ * @param uart UART device
  * @return next char in stream or EOF if end of stream
  */
-static int serial0_getc(FILE *f) {
-  (void)f;
+static inline int uart_getc(uart_t *uart) {
   int result = _FDEV_EOF;
 
-  if (!Ringbuffer.empty(UART0->rx_buffer))
-    result = Ringbuffer.remove(UART0->rx_buffer);
-  uart_handle_rx_full();
+  if (!Ringbuffer.empty(uart->rx_buffer))
+    result = Ringbuffer.remove(uart->rx_buffer);
+  uart_rx_unthrottle(uart);
 
   return result;
 }
 
-// usart data register empty interrupt
-ISR(USART0_UDRE_vect) 
-{
-  if (!Ringbuffer.empty(UART0->tx_buffer))
-    UART0->regs->UDRx = Ringbuffer.remove(UART0->tx_buffer);
-  else
-    REG_CLRBIT(UART0->regs->UCSRxB, UDRE0);
+/**
+ * USART data register empty interrupt body
+ * @param uart UART device
+ * @return void
+ */
+static inline void uart_udre_isr(uart_t *uart) {
+  int16_t c;
+  if (!uart_tx_pending(uart))
+    REG_CLRBIT(uart->regs->UCSRxB, UDRE0);
+#if UART_HW_FLOW_CTL
+  else if (!uart_read_ready_to_receive(uart))
+    uart_tx_hold(uart);
+#endif
+  else if ((c = uart_tx_next(uart)) >= 0)
+    uart->regs->UDRx = (uint8_t)c;
+}
+
+/**
+ * CTS pin change interrupt body, restarts the transmitter once the
+ * other side is ready
+ * @param uart UART device
+ * @return void
+ */
+static inline void uart_cts_isr(uart_t *uart) {
+  if (uart_read_ready_to_receive(uart)) {
+    REG_CLRBIT(*uart->cts_pcmsk, uart->cts_pcint);
+    uart_tx_kick(uart);
+  }
 }
 
-// usart receive complete
-ISR(USART0_RX_vect)
-{
-  // pray that this stops the other end in time
-  uart_handle_rx_full();
-  Ringbuffer.insert(UART0->rx_buffer, UART0->regs->UDRx, false);
+/**
+ * USART receive complete interrupt body
+ * @param uart UART device
+ * @return void
+ */
+static inline void uart_rx_isr(uart_t *uart) {
+  // DOR is only valid until UDRx is read
+  if (uart->regs->UCSRxA & _BV(DOR0))
+    uart->rx_overruns++;
+  // drop newest on a full ring, Ringbuffer.drops() counts the lost bytes
+  uart_rx_byte(uart, uart->regs->UDRx);
+  uart_rx_throttle(uart);
+}
+
+/************************************************************************/
+/* UART instances                                                       */
+/************************************************************************/
+
+/**
+ * Define the state, stdio hooks and interrupt vectors of USART n
+ *
+ * Every generated function and ISR calls the shared inline bodies above
+ * with the address of its own instance, a link time constant, so the
+ * compiler addresses the instance directly instead of through a table.
+ *
+ * @param n USART number, selects USARTn_RX_vect/USARTn_UDRE_vect and the
+ *        UARTn_* buffer sizes
+ * @param addr Address of the USART register block
+ * @param rts_ RTS pin, GPIO_PIN(port, pin)
+ * @param cts_ CTS pin, GPIO_PIN(port, pin)
+ * @param pcmsk Address of the CTS pin change mask register
+ * @param pcint CTS bit in pcmsk
+ * @param pcie CTS pin change group bit in PCICR
+ * @param stdio Nonzero to attach the instance to stdin/stdout on init
+ */
+#define UART_INSTANCE(n, addr, rts_, cts_, pcmsk, pcint, pcie, stdio)   \
+  RING_BUFFER_STORAGE(uint8_t, TX_storage ## n,                         \
+                      UART ## n ## _TX_BUFFER_SIZE);                    \
+  RING_BUFFER_STORAGE(uart_tx_desc_t, TX_queue_storage ## n,            \
+                      UART ## n ## _TX_QUEUE_SIZE);                     \
+  RING_BUFFER_STORAGE(uint8_t, RX_storage ## n,                         \
+                      UART ## n ## _RX_BUFFER_SIZE);                    \
+  RING_BUFFER_STORAGE(uint8_t, RX_frames_storage ## n,                  \
+                      UART ## n ## _RX_FRAMES_SIZE);                    \
+  static ring_buffer_t TX_buffer ## n;                                  \
+  static uart_tx_queue_t TX_queue ## n;                                 \
+  static ring_buffer_t RX_buffer ## n;                                  \
+  static uart_rx_frames_t RX_frames ## n;                               \
+                                                                        \
+  static int serial ## n ## _putc(char c, FILE*);                       \
+  static int serial ## n ## _getc(FILE*);                               \
+                                                                        \
+  static uart_t __serial ## n = {                                       \
+    .regs = (usart_atmega_regs_t *)(addr),                              \
+    .tx_buffer = &TX_buffer ## n,                                       \
+    .tx_storage = TX_storage ## n,                                      \
+    .tx_size = UART ## n ## _TX_BUFFER_SIZE,                            \
+    .tx_queue = &TX_queue ## n,                                         \
+    .tx_queue_storage = TX_queue_storage ## n,                          \
+    .tx_queue_size = UART ## n ## _TX_QUEUE_SIZE,                       \
+    .rx_buffer = &RX_buffer ## n,                                       \
+    .rx_storage = RX_storage ## n,                                      \
+    .rx_size = UART ## n ## _RX_BUFFER_SIZE,                            \
+    .rx_frames = &RX_frames ## n,                                       \
+    .rx_frames_storage = RX_frames_storage ## n,                        \
+    .rx_frames_size = UART ## n ## _RX_FRAMES_SIZE,                     \
+    .rts = rts_,                                                        \
+    .cts = cts_,                                                        \
+    .cts_pcmsk = (register_t *)(pcmsk),                                 \
+    .cts_pcint = pcint,                                                 \
+    .cts_pcie = pcie,                                                   \
+    .putc = (stdio) ? serial ## n ## _putc : NULL,                      \
+    .getc = (stdio) ? serial ## n ## _getc : NULL                       \
+  };                                                                    \
+                                                                        \
+  uart_t * const UART ## n = &__serial ## n;                            \
+                                                                        \
+  static int serial ## n ## _putc(char c, FILE *f) {                    \
+    (void)f;                                                            \
+    return uart_putc(&__serial ## n, c);                                \
+  }                                                                     \
+                                                                        \
+  static int serial ## n ## _getc(FILE *f) {                            \
+    (void)f;                                                            \
+    return uart_getc(&__serial ## n);                                   \
+  }                                                                     \
+                                                                        \
+  ISR(USART ## n ## _UDRE_vect) { uart_udre_isr(&__serial ## n); }      \
+  ISR(USART ## n ## _RX_vect) { uart_rx_isr(&__serial ## n); }
+
+// CTS pin change vector for USART n, one per pin change group
+#define UART_CTS_VECTOR(n, vect)                                        \
+  ISR(vect) { uart_cts_isr(&__serial ## n); }
+
+// Set serial0 and serial1 to the beginning
+// of USART0 and USART1 devices in memory
+UART_INSTANCE(0, 0xC0, GPIO_PIN(B,7), GPIO_PIN(B,6),
+              0x6C /* PCMSK1 */, PCINT14, PCIE1, 1)
+
+#if USE_UART1
+// TOSC pins, free while Timer2 runs from the system clock
+UART_INSTANCE(1, 0xC8, GPIO_PIN(C,6), GPIO_PIN(C,7),
+              0x6D /* PCMSK2 */, PCINT23, PCIE2, 0)
+#endif
+
+#if UART_HW_FLOW_CTL
+UART_CTS_VECTOR(0, PCINT1_vect)
+#if USE_UART1
+UART_CTS_VECTOR(1, PCINT2_vect)
+#endif
+#endif
+
+// every instance, for code that services all of them
+static uart_t * const uart_table[] = {
+  &__serial0,
+#if USE_UART1
+  &__serial1,
+#endif
+};
+
+/**
+ * Close idle-gap frames, called from the systick interrupt
+ * @return void
+ */
+void uart_rx_tick(void) {
+  for (uint8_t i = 0; i < sizeof(uart_table) / sizeof(uart_table[0]); ++i) {
+    uart_t *uart = uart_table[i];
+    if (uart->rx_idle_left && --uart->rx_idle_left == 0 && uart->rx_in_frame)
+      uart_rx_end_frame(uart);
+  }
 }
@@ -10,25 +10,175 @@
 #define UART_H_
 
 #define UART_HW_FLOW_CTL 1
+// the second USART is for boards that wire it up, -DUSE_UART1=1
+#ifndef USE_UART1
+#define USE_UART1 0
+#endif
 
 #include <stdio.h>
+#include "system.h"
 #include "atmega/usart_atmega.h"
 #include "ring_buffer.h"
 #include "gpio.h"
+#include "task.h"
+
+/**
+ * Baud rate solver
+ *
+ * The USART divides SYSCLOCK by 16*(UBRR+1), or by 8*(UBRR+1) with U2X
+ * set. Both are tried and the one closest to the requested rate wins,
+ * normal mode on a tie since it samples each bit more often. Errors are
+ * in hundredths of a percent. Everything is a constant expression for a
+ * constant baud, so UART_BAUD_ASSERT can reject a rate at compile time.
+ * Rates below UART_BAUD_MIN need more than the 12 bit UBRR and solve to a
+ * divisor of 0, which the error macros report as unreachable.
+ */
+#define UART_BAUD_TOLERANCE 200 // 2.00 %
+#define UART_BAUD_MIN (SYSCLOCK / (16UL * 4096)) // UBRR is 12 bits
+
+#define UART_BAUD_DIVISOR(baud, mul)                                    \
+  ((baud) < UART_BAUD_MIN ? 0 :                                         \
+   (SYSCLOCK + (uint32_t)(mul) * (baud) / 2) / ((uint32_t)(mul) * (baud)))
+#define UART_BAUD_ACTUAL_N(baud, mul)                                   \
+  (SYSCLOCK / ((uint32_t)(mul) *                                        \
+               (UART_BAUD_DIVISOR(baud, mul) ? UART_BAUD_DIVISOR(baud, mul) : 1)))
+#define UART_BAUD_ERROR_N(baud, mul)                                    \
+  ((UART_BAUD_DIVISOR(baud, mul) == 0 || UART_BAUD_DIVISOR(baud, mul) > 4096) \
+   ? 10000 :                                                            \
+   (UART_BAUD_ACTUAL_N(baud, mul) > (baud)                              \
+    ? UART_BAUD_ACTUAL_N(baud, mul) - (baud)                            \
+    : (baud) - UART_BAUD_ACTUAL_N(baud, mul)) * 100 / ((baud) / 100))
+
+#define UART_BAUD_U2X(baud)                                             \
+  (UART_BAUD_ERROR_N(baud, 8) < UART_BAUD_ERROR_N(baud, 16))
+#define UART_BAUD_MUL(baud) (UART_BAUD_U2X(baud) ? 8 : 16)
+#define UART_BAUD_UBRR(baud) (UART_BAUD_DIVISOR(baud, UART_BAUD_MUL(baud)) - 1)
+#define UART_BAUD_ACTUAL(baud) UART_BAUD_ACTUAL_N(baud, UART_BAUD_MUL(baud))
+#define UART_BAUD_ERROR(baud) UART_BAUD_ERROR_N(baud, UART_BAUD_MUL(baud))
+#define UART_BAUD_OK(baud) (UART_BAUD_ERROR(baud) <= UART_BAUD_TOLERANCE)
+#define UART_BAUD_ASSERT(baud)                                          \
+  _Static_assert((baud) >= UART_BAUD_MIN, "baud rate below SYSCLOCK/(16*4096)"); \
+  _Static_assert(UART_BAUD_OK(baud), "baud rate not reachable within UART_BAUD_TOLERANCE")
+
+/**
+ * Solved baud rate configuration
+ */
+typedef struct {
+  uint16_t ubrr;
+  bool u2x;
+  uint32_t actual;  // rate the USART really runs at
+  uint16_t error;   // |actual - requested| in hundredths of a percent
+} uart_baud_t;
+
+/**
+ * Pick UBRR and U2X for a baud rate, folds to constants for a constant baud
+ * @param baud Requested baud rate
+ * @param b Solution
+ * @return true if the error is within UART_BAUD_TOLERANCE
+ */
+static inline bool uart_baud_solve(uint32_t baud, uart_baud_t *b) {
+  if (baud < UART_BAUD_MIN) return false;
+  b->u2x = UART_BAUD_U2X(baud);
+  b->ubrr = UART_BAUD_UBRR(baud);
+  b->actual = UART_BAUD_ACTUAL(baud);
+  b->error = UART_BAUD_ERROR(baud);
+  return UART_BAUD_OK(baud);
+}
+
+/**
+ * Where the bytes of a TX descriptor live
+ */
+typedef enum {
+  UART_TX_RAM,  // ptr is in SRAM
+  UART_TX_PGM,  // ptr is in flash (PROGMEM)
+  UART_TX_RING  // bytes from the TX ring, up to the mark in len
+} uart_tx_src_t;
+
+/**
+ * Scatter-gather TX descriptor, walked directly by the UDRE ISR
+ */
+typedef struct {
+  const void *ptr;
+  uint16_t len;
+  uart_tx_src_t src;
+  task_t *task;     // scheduled once the last byte is handed to the UART
+} uart_tx_desc_t;
+
+RING_BUFFER_DECLARE(uart_tx_queue, uart_tx_desc_t, uint8_t)
+
+/**
+ * How the RX ISR splits incoming bytes into frames
+ */
+typedef enum {
+  UART_RX_RAW,    // no framing, readers woken on every byte
+  UART_RX_LINE,   // frame ends at rx_delim, delimiter is not stored
+  UART_RX_LENGTH, // first byte is the payload length, prefix is not stored
+  UART_RX_IDLE    // frame ends after rx_idle_ticks systicks without a byte
+} uart_rx_framing_t;
+
+RING_BUFFER_DECLARE(uart_rx_frames, uint8_t, uint8_t)
 
 typedef struct {
   usart_atmega_regs_t *regs;
+  uart_baud_t baud;
   ring_buffer_t *tx_buffer;
+  uint8_t *tx_storage;
+  uint16_t tx_size;
+  uart_tx_queue_t *tx_queue;
+  uart_tx_desc_t *tx_queue_storage;
+  uint8_t tx_queue_size;
+  uint16_t tx_pos;       // ISR: bytes sent from the head descriptor
+  uint8_t tx_ring_out;   // ISR: bytes sent from the TX ring
+  uint8_t tx_ring_in;    // producer: bytes put into the TX ring
+  uint8_t tx_ring_mark;  // producer: tx_ring_in at the last ring descriptor
   ring_buffer_t *rx_buffer;
+  uint8_t *rx_storage;
+  uint16_t rx_size;
+  uart_rx_frames_t *rx_frames;  // lengths of completed frames in rx_buffer
+  uint8_t *rx_frames_storage;
+  uint8_t rx_frames_size;
+  uart_rx_framing_t rx_mode;
+  uint8_t rx_delim;             // UART_RX_LINE terminator
+  uint8_t rx_idle_ticks;        // UART_RX_IDLE gap
+  uint8_t rx_count;             // ISR: bytes stored in the current frame
+  uint8_t rx_expect;            // ISR: UART_RX_LENGTH payload bytes left
+  uint8_t rx_idle_left;         // ISR: systicks until the frame goes idle
+  bool rx_in_frame;             // ISR: a frame has started
+  bool rx_discard;              // ISR: no room for the current frame
+  volatile uint8_t rx_frame_drops; // frames lost or cut, see uart_rx_throttle
+  uint8_t rx_high;              // RTS off once rx_buffer holds this many
+  uint8_t rx_low;               // RTS back on once it drains to this many
+  volatile bool rx_throttled;   // RTS is deasserted
+  volatile uint16_t rx_overruns;// bytes lost in the USART (DOR)
   gpio_pin_t * rts;
   gpio_pin_t * cts;
+  register_t * cts_pcmsk; // pin change mask register for cts
+  uint8_t cts_pcint;      // cts bit in cts_pcmsk
+  uint8_t cts_pcie;       // pin change group enable bit in PCICR
   int(*putc)(char, FILE*);
   int(*getc)(FILE*);	
 } uart_t;
 
-void uart_init(uart_t *uart, uint32_t baud);
+bool uart_init(uart_t *uart, uint32_t baud);
+uint16_t uart_write_async(uart_t *uart, const uint8_t *buf, uint16_t len,
+                          task_t *task, task_sched_t *sched);
+task_sched_t uart_flush_async(uart_t *uart, task_t *task);
+bool uart_send(uart_t *uart, const void *buf, uint16_t len, uart_tx_src_t src,
+               task_t *task, task_sched_t *sched);
+bool uart_puts_P(uart_t *uart, const char *s, task_t *task, task_sched_t *sched);
+int uart_putc(uart_t *uart, char c);
+void uart_rx_framing(uart_t *uart, uart_rx_framing_t mode, uint8_t arg);
+task_sched_t uart_rx_wait_frame(uart_t *uart, task_t *task);
+int16_t uart_rx_read_frame(uart_t *uart, uint8_t *dst, uint8_t max);
+void uart_rx_tick(void);
+bool uart_rx_watermarks(uart_t *uart, uint8_t high, uint8_t low);
+uint16_t uart_rx_overruns(const uart_t *uart);
+uint8_t uart_rx_drops(const uart_t *uart);
+uint8_t uart_rx_frame_drops(const uart_t *uart);
 
 extern uart_t * const UART0;
+#if USE_UART1
 extern uart_t * const UART1;
+#endif
 
 #endif /* UART_H_ */
@@ -5,91 +5,362 @@
  *  Author: Greg Cook
  *
  * Configurable terminal display with default layout
+ *
+ * Region lines are written into a shadow copy of the screen in RAM. Only
+ * cells that actually change are marked dirty. A compositor task runs
+ * every region's render callback once per frame, then packs the dirty
+ * runs into one buffer sent as a single UART descriptor. The next frame
+ * waits for that send to finish, so the terminal can never get ahead of
+ * the UART and an unchanged dashboard costs no bytes at all.
  */ 
 
-#include<stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <avr/pgmspace.h>
 #include "vt100.h"
+#include "fmt.h"
 
 static term_t __term0 = {
+  .frame_task = { .start_ticks = 1000 / TERM_FRAME_HZ },
   .scroll = {	.start = 7, .end = 13 },
   .region = {	
     { .pos = { .r = 2, .c = 2 },
-      .line_count = 4,
+      .line_count = TERM_REGION_LINES,
       .current_line = 0 }, 
     { .pos = { .r = 2, .c = 41 },
-      .line_count = 4,
+      .line_count = TERM_REGION_LINES,
       .current_line = 0 },
+#if TERM_REGIONS > 2
     { .pos = { .r = 16, .c = 2 },
-      .line_count = 4,
+      .line_count = TERM_REGION_LINES,
       .current_line = 0 },
+#endif
+#if TERM_REGIONS > 3
     { .pos = { .r = 16, .c = 41 },
-      .line_count = 4,
+      .line_count = TERM_REGION_LINES,
       .current_line = 0 }
+#endif
   }
 };
 
 term_t * const TERM0 = &__term0;
 
 // Save Cursor	<ESC>[s
-static inline void vt100_save_cursor(void) {
-  printf( ESC "[s");
+static inline void vt100_save_cursor(fmt_sink_t *out) {
+  fmt_str_P(out, PSTR(ESC "[s"));
 }
 
 // Unsave Cursor <ESC>[u
-static inline void vt100_unsave_cursor(void) {
-  printf( ESC "[u" );
+static inline void vt100_unsave_cursor(fmt_sink_t *out) {
+  fmt_str_P(out, PSTR(ESC "[u"));
 }
 
 // Cursor Down <ESC>[{COUNT}B
-static inline void vt100_cursor_down(int count) {
-  printf( ESC "[%dB", count);
+static inline void vt100_cursor_down(fmt_sink_t *out, int count) {
+  fmt_str_P(out, PSTR(ESC "["));
+  fmt_int(out, count, 0, ' ');
+  fmt_char(out, 'B');
 }
 
 
 // Erase Screen <ESC>[2J
-static inline void vt100_erase_screen(void) {
-  printf( ESC "[2J" );
+static inline void vt100_erase_screen(fmt_sink_t *out) {
+  fmt_str_P(out, PSTR(ESC "[2J"));
 }
 
 // Home <ESC>[{row};{col}H
-static inline void vt100_cursor_home(coord_t pos) {
-  printf( ESC "[%d;%dH", pos.r, pos.c );
+static inline void vt100_cursor_home(fmt_sink_t *out, coord_t pos) {
+  fmt_str_P(out, PSTR(ESC "["));
+  fmt_uint(out, pos.r, 0, ' ');
+  fmt_char(out, ';');
+  fmt_uint(out, pos.c, 0, ' ');
+  fmt_char(out, 'H');
 }
 
 // scroll_screen <ESC>[{start};{end}r
-static inline void vt100_scroll_screen(scroll_t scroll) {
-  printf( ESC "[%d;%dr", scroll.start, scroll.end );
+static inline void vt100_scroll_screen(fmt_sink_t *out, scroll_t scroll) {
+  fmt_str_P(out, PSTR(ESC "["));
+  fmt_uint(out, scroll.start, 0, ' ');
+  fmt_char(out, ';');
+  fmt_uint(out, scroll.end, 0, ' ');
+  fmt_char(out, 'r');
+}
+
+// a cursor move costs up to 8 bytes, resending this many clean cells is cheaper
+#define TERM_GAP_MAX 6
+
+static inline bool term_is_dirty(const term_t *t, uint8_t line, uint8_t col) {
+  return t->dirty[line][col >> 3] & (1 << (col & 7));
+}
+
+/**
+ * Write one cell of the line opened by term_region_begin
+ * @param sink Terminal sink
+ * @param c Character
+ * @return void
+ */
+static void term_put(fmt_sink_t *sink, char c) {
+  term_t *t = (term_t *)sink;
+  uint8_t col = t->wr_col;
+
+  if (col >= TERM_COLS) return;
+  t->wr_col = col + 1;
+  if (t->cells[t->wr_line][col] != c) {
+    t->cells[t->wr_line][col] = c;
+    t->dirty[t->wr_line][col >> 3] |= 1 << (col & 7);
+  }
+}
+
+// room kept at the end of a frame for the restore cursor sequence
+#define TERM_FRAME_TAIL 3
+// longest cursor move, ESC [ rr ; cc H
+#define TERM_CUP_MAX 8
+
+/**
+ * Append one byte to the frame being composed
+ * @param sink Frame sink
+ * @param c Character
+ * @return void
+ */
+static void term_frame_put(fmt_sink_t *sink, char c) {
+  term_t *t = (term_t *)((char *)sink - offsetof(term_t, frame_sink));
+  if (t->frame_len < TERM_FRAME_MAX)
+    t->frame[t->frame_len++] = c;
+}
+
+static inline bool term_frame_room(const term_t *t, uint8_t n) {
+  return TERM_FRAME_MAX - t->frame_len >= n + TERM_FRAME_TAIL;
+}
+
+/**
+ * Pack the dirty runs of one shadow line into the frame
+ *
+ * Cells are only marked clean once they are in the frame, so whatever
+ * does not fit goes out with the next frame.
+ *
+ * @param t Terminal object
+ * @param line Shadow line
+ * @param pos Screen position of the line's first cell
+ * @return false if the frame filled up
+ */
+static bool term_compose_line(term_t *t, uint8_t line, coord_t pos) {
+  int8_t at = -TERM_GAP_MAX - 1;  // column the terminal cursor is on
+
+  for (uint8_t col = 0; col < TERM_COLS; ++col) {
+    if (!term_is_dirty(t, line, col)) continue;
+
+    if (col - at > TERM_GAP_MAX) {
+      if (!term_frame_room(t, TERM_CUP_MAX + 1)) return false;
+      vt100_cursor_home(&t->frame_sink, (coord_t){ pos.r, pos.c + col });
+    }
+    else {
+      if (!term_frame_room(t, col - at + 1)) return false;
+      while (at < col) term_frame_put(&t->frame_sink, t->cells[line][at++]);
+    }
+
+    while (col < TERM_COLS && term_is_dirty(t, line, col)) {
+      if (!term_frame_room(t, 1)) return false;
+      term_frame_put(&t->frame_sink, t->cells[line][col]);
+      t->dirty[line][col >> 3] &= ~(1 << (col & 7));
+      col++;
+    }
+    at = col;
+  }
+  return true;
+}
+
+/**
+ * Render every region and pack the changed cells into the frame buffer,
+ * leaving the cursor where it was
+ *
+ * Packing starts at the line the previous frame ran out of room on, so
+ * lines that change every frame cannot starve the ones after them.
+ *
+ * @param t Terminal object
+ * @return frame length, 0 if nothing changed
+ */
+static uint8_t term_compose(term_t *t) {
+  uint8_t line = t->frame_from;
+  t->frame_len = 0;
+  t->frame_from = 0;  // unless this frame runs out of room
+
+  for (uint8_t r = 0; r < TERM_REGIONS; ++r)
+    if (t->region[r].render)
+      t->region[r].render(t, r, t->region[r].render_data);
+
+  for (uint8_t i = 0; i < TERM_LINES; ++i, line = (line + 1) % TERM_LINES) {
+    uint8_t r = line / TERM_REGION_LINES;
+    uint8_t ln = line % TERM_REGION_LINES;
+    uint8_t any = 0;
+    if (ln >= t->region[r].line_count) continue;
+    for (uint8_t j = 0; j < sizeof(t->dirty[line]); ++j)
+      any |= t->dirty[line][j];
+    if (!any) continue;
+
+    if (t->frame_len == 0)
+      vt100_save_cursor(&t->frame_sink);
+    if (!term_compose_line(t, line, (coord_t){ t->region[r].pos.r + ln, t->region[r].pos.c })) {
+      t->frame_from = line;
+      break;
+    }
+  }
+
+  if (t->frame_len)
+    vt100_unsave_cursor(&t->frame_sink);
+  return t->frame_len;
+}
+
+typedef enum {
+  TERM_FRAME_COMPOSE,
+  TERM_FRAME_SEND,
+  TERM_FRAME_SENT
+} term_frame_state_t;
+
+static task_slice_result_t term_frame_send(task_t *task);
+
+/**
+ * Compositor: render and pack a frame once per frame period
+ */
+static task_slice_result_t term_frame_compose(task_t *task) {
+  if (term_compose(task->fdata) == 0)
+    return (task_slice_result_t){TERM_FRAME_COMPOSE, TASK_RESCHED};
+  return term_frame_send(task);
+}
+
+/**
+ * Queue the frame as one descriptor, woken again once it is on the wire
+ * (or once there is a free descriptor to retry with)
+ */
+static task_slice_result_t term_frame_send(task_t *task) {
+  term_t *t = task->fdata;
+  task_sched_t sched;
+  if (uart_send(t->uart, t->frame, t->frame_len, UART_TX_RAM, task, &sched))
+    return (task_slice_result_t){TERM_FRAME_SENT, sched};
+  return (task_slice_result_t){TERM_FRAME_SEND, sched};
+}
+
+/**
+ * Frame sent, the buffer is free, wait for the next frame period
+ */
+static task_slice_result_t term_frame_sent(task_t *task) {
+  (void)task;
+  return (task_slice_result_t){TERM_FRAME_COMPOSE, TASK_RESCHED};
+}
+
+static const ROM task_slice_callback_fp term_frame_slices[] = {
+  term_frame_compose,
+  term_frame_send,
+  term_frame_sent
+};
+
+/**
+ * Register the render callback for a region, called once per frame
+ * @param t Terminal object
+ * @param r Region index, integer into layout object
+ * @param render Render callback, NULL to stop rendering the region
+ * @param data Passed to render
+ * @return void
+ */
+void term_region_render(term_t *t, int r, term_render_fp render, void *data) {
+  t->region[r].render = render;
+  t->region[r].render_data = data;
+}
+
+/**
+ * Set how often the compositor renders and sends a frame
+ * @param t Terminal object
+ * @param hz Frames per second, 1 to 255, 0 is taken as 1
+ * @return void
+ */
+void term_set_frame_rate(term_t *t, uint8_t hz) {
+  Task.set_ticks(&t->frame_task, 1000 / (hz ? hz : 1));
 }
 
 /**
  * Initialize Terminal object
+ *
+ * Clears the screen and starts the compositor. The screen starts out
+ * blank, matching an all space shadow.
+ *
+ * @param t Terminal object
+ * @param uart UART the terminal is attached to
+ * @return void
+ */
+void term_init(term_t *t, uart_t *uart) {
+  t->uart = uart;
+  t->sink.put = term_put;
+  fmt_uart_init(&t->tx, uart);
+  memset(t->cells, ' ', sizeof(t->cells));
+  memset(t->dirty, 0, sizeof(t->dirty));
+
+  t->frame_sink.put = term_frame_put;
+  t->frame_len = 0;
+  t->frame_from = 0;
+
+  vt100_erase_screen(&t->tx.sink);
+  vt100_scroll_screen(&t->tx.sink, t->scroll);
+
+  Task.init(&t->frame_task, term_frame_slices, t);
+  Task.schedule(&t->frame_task, TASK_RESCHED);
+}
+
+/**
+ * Start rewriting a region line in the shadow screen. Append the line
+ * with the fmt_* helpers on the returned sink, then call term_region_end.
+ * @param t Terminal object
+ * @param r Region index, integer into layout object
+ * @param ln Line in region, integer into Region object
+ * @return sink writing into the line
+ */
+fmt_sink_t *term_region_begin(term_t *t, int r, int ln) {
+  t->wr_line = r * TERM_REGION_LINES + ln;
+  t->wr_col = 0;
+  return &t->sink;
+}
+
+/**
+ * Finish the line opened by term_region_begin, blanking whatever is left
+ * of the previous contents
  * @param t Terminal object
  * @return void
  */
-void term_init(term_t *t) {
-  vt100_erase_screen();
-  vt100_scroll_screen(t->scroll);
+void term_region_end(term_t *t) {
+  while (t->wr_col < TERM_COLS)
+    term_put(&t->sink, ' ');
 }
 
 /**
- * Print string in terminal line, similar to printf
+ * Print string in terminal line, similar to printf. The change shows up
+ * in the next frame.
  * @param t Terminal object 
  * @param r Region index, integer into layout object
  * @param ln Line in region, integer into Region object
- * @param fmt Format string, uses the same format as printf
+ * @param fmt Format string, the printf subset fmt_printf supports
  * @param ... List of Variables to print in format string, same as printf
  * @return void
  */
 void term_display_region(term_t *t, int r, int ln, char *fmt, ...) {
   va_list arg;
   va_start(arg, fmt);
-	
-  vt100_save_cursor();
-  vt100_cursor_home((coord_t){t->region[r].pos.r + ln, t->region[r].pos.c});
-	
-  vprintf(fmt, arg);
+  fmt_vprintf(term_region_begin(t, r, ln), fmt, arg);
+  va_end(arg);
+  term_region_end(t);
+}
+
+/**
+ * term_display_region with the format string in flash
+ * @param t Terminal object 
+ * @param r Region index, integer into layout object
+ * @param ln Line in region, integer into Region object
+ * @param fmt Format string in PROGMEM, e.g. PSTR("ADC [%4d]")
+ * @param ... List of Variables to print in format string, same as printf
+ * @return void
+ */
+void term_display_region_P(term_t *t, int r, int ln, const char *fmt, ...) {
+  va_list arg;
+  va_start(arg, fmt);
+  fmt_vprintf_P(term_region_begin(t, r, ln), fmt, arg);
   va_end(arg);
-	
-  vt100_unsave_cursor();
+  term_region_end(t);
 }
@@ -11,6 +11,39 @@
 #ifndef VT100_H_
 #define VT100_H_
 
+#include "uart.h"
+#include "fmt.h"
+#include "task.h"
+
+/*
+ * The shadow screen costs TERM_LINES * (TERM_COLS + (TERM_COLS + 7) / 8)
+ * bytes of SRAM plus TERM_FRAME_MAX for the frame, so size these to the
+ * layout (override with -D, up to 4 regions). The defaults fit the demo,
+ * 2 regions of 4 lines of 20 characters: 160 + 24 + 32 = 216 bytes.
+ */
+#ifndef TERM_REGIONS
+#define TERM_REGIONS 2
+#endif
+#ifndef TERM_REGION_LINES
+#define TERM_REGION_LINES 4   // most lines a region can have
+#endif
+#ifndef TERM_COLS
+#define TERM_COLS 20          // width of a region line, longer text is cut
+#endif
+#ifndef TERM_FRAME_MAX
+#define TERM_FRAME_MAX 32     // most bytes sent per frame
+#endif
+#define TERM_LINES (TERM_REGIONS * TERM_REGION_LINES)
+#define TERM_FRAME_HZ 10      // default compositor frame rate
+
+typedef struct term_t term_t;
+
+/**
+ * Region render callback, called by the compositor once per frame to
+ * rewrite the region's lines (term_region_begin/end, term_display_region)
+ */
+typedef void (*term_render_fp)(term_t *t, int r, void *data);
+
 typedef struct {
   char r;
   char c;
@@ -25,18 +58,37 @@ typedef struct {
   coord_t pos;
   char line_count;
   char current_line;	
+  term_render_fp render;
+  void *render_data;
 } region_t;
 
-typedef struct {
+struct term_t {
+  fmt_sink_t sink;        // region line writer, first so term_put can cast back
   coord_t cursor;
   scroll_t scroll;
-  region_t region[4];
-} term_t;
+  region_t region[TERM_REGIONS];
+  uart_t *uart;
+  fmt_uart_t tx;          // escape sequences sent at init
+  task_t frame_task;      // compositor
+  uint8_t wr_line;        // shadow line being written
+  uint8_t wr_col;         // next column in wr_line
+  char cells[TERM_LINES][TERM_COLS];          // shadow of the region lines
+  uint8_t dirty[TERM_LINES][(TERM_COLS + 7) / 8]; // cells not on screen yet
+  fmt_sink_t frame_sink;  // appends to frame
+  uint8_t frame_len;
+  uint8_t frame_from;     // shadow line the next frame starts packing at
+  char frame[TERM_FRAME_MAX];                 // output of one frame, in flight until sent
+};
 
 extern term_t * const TERM0;
 
 #define ESC "\x1b"
 
-void term_init(term_t *t);
+void term_init(term_t *t, uart_t *uart);
 void term_display_region(term_t *t, int r, int ln, char *fmt, ...);
+void term_display_region_P(term_t *t, int r, int ln, const char *fmt, ...);
+fmt_sink_t *term_region_begin(term_t *t, int r, int ln);
+void term_region_end(term_t *t);
+void term_region_render(term_t *t, int r, term_render_fp render, void *data);
+void term_set_frame_rate(term_t *t, uint8_t hz);
 #endif /* VT100_H_ */